@@ -3,9 +3,11 @@
 #include "idt.h"
 #include "ioapic.h"
 #include "page.h"
+#include "smp.h"
 #include "x86.h"
 
 #include "kernel/acpi.h"
+#include "kernel/limine_reqs.h"
 #include "util/print.h"
 
 #include <stdint.h>
@@ -45,47 +47,30 @@ void apic_eoi(void) {
 	lapic_write(APIC_EOI, 0);
 }
 
+/**
+ * @brief Send a fixed interrupt to another processor.
+ * @param dest_lapic_id The Local APIC ID of the destination processor.
+ * @param vector The vector to raise on the destination.
+ */
+void apic_send_ipi(uint32_t dest_lapic_id, uint8_t vector) {
+	/* Writing the low half sends the IPI, nothing may come in between */
+	irq_disable();
+	lapic_write(APIC_ICR_HIGH, dest_lapic_id << 24);
+	lapic_write(APIC_ICR_LOW, vector);
+	irq_enable();
+}
+
 static void apic_spurious_handler(struct interrupt_frame *) {
 	return;
 }
 
 /**
- * @brief Initialize the Processor Local APIC and IOAPIC(s).
+ * @brief Configure the Local APIC of the current processor.
+ * @param acpi_uid The ACPI Processor UID of the current processor.
  */
-
-void apic_init(void) {
-	kprint("Initializing APIC...\n");
-
+static void lapic_setup(uint32_t acpi_uid) {
 	struct MADT *madt = acpi_get_table(ACPI_MADT);
 
-	if (madt->PCAT_COMPAT) {
-		/* Disable the 8259 compatible PIC */
-		outb(0x21, 0xFF);
-		outb(0xA1, 0xFF);
-	}
-
-	/* Get the phyiscal base of the APIC from the MADT */
-	uint64_t lapic_phys_base
-		= (uint64_t)madt->Local_Interrupt_Controller_Address;
-
-	char *madt_entry = madt->Interrupt_Controller_Structure;
-	for (; (void *)madt_entry < (void *)madt + madt->Length;
-		madt_entry += *(madt_entry + 1)) {
-		/* Local APIC Address Override */
-		if (madt_entry[0] != 5) {
-			continue;
-		}
-
-		lapic_phys_base = *(uint64_t *)(madt_entry + 4);
-	}
-
-	/* Map the APIC into virtual memory */
-	lapic = kmap((void *)lapic_phys_base, nullptr, 4'096,
-		PAGE_PRESENT | PAGE_PCD | PAGE_WRITE | PAGE_GLOBAL);
-
-	lapic_id = lapic_read(APIC_ID) << 24;
-	kprintf("Processor Local APIC ID: %w8X\n", lapic_id);
-
 	/* Disable all LVT entries */
 	lapic_write(APIC_LVT_CMCI, APIC_LVT_MASK);
 	lapic_write(APIC_LVT_TIMER, APIC_LVT_MASK);
@@ -96,17 +81,18 @@ void apic_init(void) {
 	lapic_write(APIC_LVT_ERROR, APIC_LVT_MASK);
 
 	/* Configure LINT0/LINT1 according to the MADT */
-	madt_entry = madt->Interrupt_Controller_Structure;
+	char *madt_entry = madt->Interrupt_Controller_Structure;
 	for (; (void *)madt_entry < (void *)madt + madt->Length;
 		madt_entry += *(madt_entry + 1)) {
 		if (madt_entry[0] != 4 /* Local APIC NMI */) {
 			continue;
 		}
 
-		/* Note: technically one would need to consider the ACPI Processor UID,
-		 * this Local APIC NMI Structure is associated with, but since this
-		 * kernel is designed for a uniprocessor system and will most likely
-		 * only ever run on Qemu, this Problem will be ignored for now. */
+		/* A Processor UID of 0xFF applies to all processors */
+		if ((uint8_t)madt_entry[2] != 0xFF
+			&& (uint8_t)madt_entry[2] != acpi_uid) {
+			continue;
+		}
 
 		enum apic_reg reg;
 		if (madt_entry[5] == 0) {
@@ -124,10 +110,68 @@ void apic_init(void) {
 		/* Register the LINT to the NMI vector (2) */
 		lapic_write(reg, polarity | trigger_mode | (0b100 << 8) | 2);
 	}
-	ioapic_init();
 
-	idt_register(0xFF, apic_spurious_handler);
 	lapic_write(APIC_SPURIOUS_INT, APIC_SOFTWARE_ENABLE | 0xFF);
 	wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | APIC_MSR_ENABLE);
+}
+
+/**
+ * @brief Initialize the Processor Local APIC of the BSP and the IOAPIC(s).
+ */
+void apic_init(void) {
+	kprint("Initializing APIC...\n");
+
+	struct MADT *madt = acpi_get_table(ACPI_MADT);
+
+	if (madt->PCAT_COMPAT) {
+		/* Disable the 8259 compatible PIC */
+		outb(0x21, 0xFF);
+		outb(0xA1, 0xFF);
+	}
+
+	/* Get the phyiscal base of the APIC from the MADT */
+	uint64_t lapic_phys_base
+		= (uint64_t)madt->Local_Interrupt_Controller_Address;
+
+	char *madt_entry = madt->Interrupt_Controller_Structure;
+	for (; (void *)madt_entry < (void *)madt + madt->Length;
+		madt_entry += *(madt_entry + 1)) {
+		/* Local APIC Address Override */
+		if (madt_entry[0] != 5) {
+			continue;
+		}
+
+		lapic_phys_base = *(uint64_t *)(madt_entry + 4);
+	}
+
+	/* Map the APIC into virtual memory */
+	lapic = kmap((void *)lapic_phys_base, nullptr, 4'096,
+		PAGE_PRESENT | PAGE_PCD | PAGE_WRITE | PAGE_GLOBAL);
+
+	/* The ID is in the upper 8 bits of the register */
+	lapic_id = lapic_read(APIC_ID) >> 24;
+	kprintf("Processor Local APIC ID: %w8X\n", lapic_id);
+
+	/* Find the ACPI Processor UID of the BSP */
+	uint32_t acpi_uid = 0xFF;
+	if (limine_smp_response) {
+		for (uint64_t i = 0; i < limine_smp_response->cpu_count; ++i) {
+			if (limine_smp_response->cpus[i]->lapic_id == lapic_id) {
+				acpi_uid = limine_smp_response->cpus[i]->processor_id;
+			}
+		}
+	}
+
+	idt_register(0xFF, apic_spurious_handler);
+	lapic_setup(acpi_uid);
+	ioapic_init();
 	kprint("Initializing APIC: Success\n");
 }
+
+/**
+ * @brief Initialize the Processor Local APIC of an application processor.
+ * @param acpi_uid The ACPI Processor UID of the processor.
+ */
+void apic_init_ap(uint32_t acpi_uid) {
+	lapic_setup(acpi_uid);
+}
@@ -5,8 +5,10 @@
 extern uint8_t lapic_id;
 
 void apic_init(void);
+void apic_init_ap(uint32_t acpi_uid);
 
 void apic_eoi(void);
+void apic_send_ipi(uint32_t dest_lapic_id, uint8_t vector);
 
 /**
  * @enum apic_reg
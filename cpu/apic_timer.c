@@ -2,17 +2,21 @@
 
 #include "apic.h"
 #include "idt.h"
+#include "smp.h"
 
+#include "kernel/spinlock.h"
 #include "util/panic.h"
 
 #include <cpuid.h>
 #include <stdint.h>
 
-static void (*timer_handler)(struct interrupt_frame *frame);
+/* Each processor has its own Local APIC timer, its state is in struct cpu */
+static struct spinlock init_lock = SPINLOCK_INIT;
 
 static void _timer_handler(struct interrupt_frame *frame) {
-	timer_handler(frame);
+	/* irq_exit() may switch to another thread and only return much later */
 	apic_eoi();
+	this_cpu_read(timer_handler)(frame);
 }
 
 enum apic_timer_divide {
@@ -27,7 +31,7 @@ enum apic_timer_divide {
 };
 
 /**
- * @brief Set the Local APIC timer.
+ * @brief Set the Local APIC timer of the current processor.
  * @param time The time in nanoseconds.
  * @param handler An interrupt handler, to be registered for the timer.
  * @param mode The mode in which the timer is running. Can be
@@ -38,15 +42,16 @@ void apic_set_timer(uint64_t time, interrupt_handler handler,
 	static bool did_init = false;
 	static uint8_t vector;
 	static uint32_t hz_frequency;
+
+	spin_lock_irqsave(&init_lock);
 	if (!did_init) {
 		// TODO: find a portable way to determine frequency
-		uint32_t eax = 0x15, ebx, ecx, edx;
-		__cpuid(0, eax, ebx, ecx, edx);
+		uint32_t eax, ebx, ecx, edx;
+		__cpuid(0x15, eax, ebx, ecx, edx);
 		if (ecx) {
 			hz_frequency = ecx;
 		} else {
-			eax = 0x16;
-			__cpuid(0, eax, ebx, ecx, edx);
+			__cpuid(0x16, eax, ebx, ecx, edx);
 			if (!ecx) {
 				panic("Could not determine APIC timer frequenzy.");
 			}
@@ -54,15 +59,19 @@ void apic_set_timer(uint64_t time, interrupt_handler handler,
 		}
 
 		vector = idt_alloc_vector();
+		idt_register(vector, _timer_handler);
+		did_init = true;
+	}
+	spin_unlock(&init_lock);
+
+	if (!this_cpu_read(timer_initialized)) {
 		/* Disable the timer, enable the LVT entry */
 		lapic_write(APIC_TIMER_INIT, 0);
 		lapic_write(APIC_LVT_TIMER, (mode << 17) | vector);
-
-		idt_register(vector, _timer_handler);
-		did_init = true;
+		this_cpu_write(timer_initialized, true);
 	}
 
-	timer_handler = handler;
+	this_cpu_write(timer_handler, handler);
 
 	/* Start the timer */
 	uint64_t count = time * hz_frequency / 1'000'000'000;
@@ -90,28 +99,31 @@ void apic_set_timer(uint64_t time, interrupt_handler handler,
 
 	lapic_write(APIC_TIMER_DIVIDE, divide);
 	lapic_write(APIC_TIMER_INIT, count);
+	irq_enable();
 }
 
 /**
- * @brief Stop the APIC timer.
+ * @brief Stop the APIC timer of the current processor.
  */
 void apic_stop_timer(void) {
 	lapic_write(APIC_TIMER_INIT, 0);
 }
 
-static uint64_t timer_current;
-
 /**
- * @brief Pause the APIC timer.
+ * @brief Pause the APIC timer of the current processor.
  */
 void apic_pause_timer(void) {
-	timer_current = lapic_read(APIC_TIMER_CURRENT);
+	irq_disable();
+	this_cpu_write(timer_current, lapic_read(APIC_TIMER_CURRENT));
 	lapic_write(APIC_TIMER_INIT, 0);
+	irq_enable();
 }
 
 /**
- * @brief Resume the APIC timer.
+ * @brief Resume the APIC timer of the current processor.
  */
 void apic_resume_timer(void) {
-	lapic_write(APIC_TIMER_INIT, timer_current);
+	irq_disable();
+	lapic_write(APIC_TIMER_INIT, this_cpu_read(timer_current));
+	irq_enable();
 }
@@ -1,8 +1,8 @@
 #include "gdt.h"
 
+#include "smp.h"
 #include "x86.h"
 
-#include "kernel/limine_reqs.h"
 #include "util/print.h"
 
 #include <stdint.h>
@@ -39,18 +39,16 @@ struct [[gnu::packed]] tss {
 	uint16_t io_pb_base;
 };
 
-static volatile struct tss tss;
+/* Every processor has its own GDT, since the TSS descriptor is marked busy once
+ * it is loaded */
+static volatile struct tss tss[SMP_MAX_CPUS];
 
 static volatile void *isr_stack;
 
-alignas(8) static volatile char gdt[56];
+alignas(8) static volatile char gdts[SMP_MAX_CPUS][56];
 
-/**
- * @brief Initialize the GDT with a kernel and a user code segment, a data
- * segment for both an an entry for a tss.
- */
-void gdt_init(void) {
-	kprint("Preparing GDT...\n");
+static void gdt_setup(uint32_t cpu) {
+	volatile char *gdt = gdts[cpu];
 
 	*(uint64_t *)&gdt[GDT_NULL] = 0;
 
@@ -67,27 +65,23 @@ void gdt_init(void) {
 	*(uint64_t *)&gdt[GDT_USER_DS]
 		= SEG_DATA | SEG_PRESENT | SEG_DPL_3 | DS_WRITABLE;
 
-	uint64_t tss_phys
-		= (uint64_t)&tss - limine_kernel_address_response->virtual_base
-	    + limine_kernel_address_response->physical_base;
+	/* The TSS base is a linear address */
 	*(__uint128_t *)&gdt[GDT_TSS]
-		= SYS_SEG_TSS | SEG_PRESENT | SEG_DPL_3 | SYS_SEG_SPLIT_BASE(tss_phys)
-	    | SYS_SEG_SPLIT_LIMIT(sizeof(tss));
+		= SYS_SEG_TSS | SEG_PRESENT | SEG_DPL_3
+	    | SYS_SEG_SPLIT_BASE((uint64_t)&tss[cpu])
+	    | SYS_SEG_SPLIT_LIMIT(sizeof(tss[cpu]));
 
-	kprint("Loading GDT...\n");
-	lgdt(sizeof(gdt) - 1, (uint64_t)gdt);
-	kprint("Loading GDT: Success\n");
+	lgdt(sizeof(gdts[cpu]) - 1, (uint64_t)gdt);
 
-	kprint("Loading TSS...\n");
-	tss.rsp0 = (uint64_t)isr_stack;
+	tss[cpu].rsp0 = (uint64_t)isr_stack;
 	ltr(GDT_TSS);
-	kprint("Loading TSS: Success\n");
 
-	kprint("Loading segment registers...\n");
 	/* load %ds, %es, %fs, %gs, %ss */
 	/* Note: apparently ds,es,ss contents are ignored entirely, NULL selector
 	 * should also work...a full GDT is still needed for syscall/sysret though
 	 */
+	/* Loading %gs clears its base, which points to the per-processor area */
+	uint64_t gs_base = rdmsr(MSR_IA32_GS_BASE);
 	asm volatile(
 		"movw $0x10, %%ax\n"
 		"movw %%ax, %%ds\n"
@@ -98,6 +92,7 @@ void gdt_init(void) {
 		:
 		:
 		: "ax");
+	wrmsr(MSR_IA32_GS_BASE, gs_base);
 	/* load %cs with a far return, -mno-red-zone is required */
 	asm volatile goto(
 		"pushq $0x8\n"
@@ -108,5 +103,22 @@ void gdt_init(void) {
 		:
 		: ret);
 ret:
-	kprint("Loading segment registers: Success\n");
+}
+
+/**
+ * @brief Initialize the GDT of the BSP with a kernel and a user code segment, a
+ * data segment for both an an entry for a tss.
+ */
+void gdt_init(void) {
+	kprint("Loading GDT, TSS and segment registers...\n");
+	gdt_setup(0);
+	kprint("Loading GDT, TSS and segment registers: Success\n");
+}
+
+/**
+ * @brief Initialize the GDT of an application processor.
+ * @param cpu The index of the processor.
+ */
+void gdt_init_ap(uint32_t cpu) {
+	gdt_setup(cpu);
 }
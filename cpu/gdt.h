@@ -20,3 +20,4 @@
 #define SEG_DATA ((uint64_t)0b10 << 43)
 
 void gdt_init(void);
+void gdt_init_ap(uint32_t cpu);
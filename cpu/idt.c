@@ -2,37 +2,59 @@
 
 #include "interrupt.h"
 #include "isr.h"
+#include "smp.h"
 #include "x86.h"
 
+#include "kernel/rcu.h"
+#include "kernel/softirq.h"
+#include "util/bitmap.h"
 #include "util/print.h"
 
 #include <stdint.h>
 
 alignas(16) volatile __uint128_t idt[256];
+/* Read under RCU by interrupt_stub() */
 static interrupt_handler handlers[265];
-
-static uint64_t irq_disable_count = 0;
+/* Vectors that are allocated or have a handler */
+static uint64_t vectors_used[BITMAP_WORDS(256)];
 
 /**
- * @brief Enable irqs. Can stack such that irqs are only enabled again
- * once for every call to irq_disable irq_enable has been called.
+ * @brief Enable irqs on this processor. Can stack such that irqs are only
+ * enabled again once for every call to irq_disable irq_enable has been called.
  */
 void irq_enable(void) {
-	if (irq_disable_count > 1) {
-		--irq_disable_count;
+	/* irqs are still disabled, so this cannot move to another processor */
+	if (this_cpu_read(irq_disable_count) > 1) {
+		this_cpu_add(irq_disable_count, -1);
 	} else {
-		--irq_disable_count;
+		this_cpu_add(irq_disable_count, -1);
 		sti();
 	}
 }
 
 /**
- * @brief Disable irqs. Can stack such that irqs are only enabled again
- * once for every call to irq_disable irq_enable has been called.
+ * @brief Disable irqs on this processor. Can stack such that irqs are only
+ * enabled again once for every call to irq_disable irq_enable has been called.
  */
 void irq_disable(void) {
 	cli();
-	++irq_disable_count;
+	this_cpu_add(irq_disable_count, 1);
+}
+
+/**
+ * @brief Enable irqs and wait for the next one, or for a write to the address
+ * armed with monitor() if mwait is set. No irq can arrive in between, so the
+ * caller can check for work with irqs disabled before. Must balance the
+ * outermost irq_disable().
+ * @param mwait Whether to use mwait instead of hlt.
+ */
+void irq_enable_wait(bool mwait) {
+	this_cpu_add(irq_disable_count, -1);
+	if (mwait) {
+		sti_mwait();
+	} else {
+		sti_hlt();
+	}
 }
 
 void dump_frame(struct interrupt_frame *frame) {
@@ -49,17 +71,13 @@ void dump_frame(struct interrupt_frame *frame) {
 }
 
 /**
- * @brief Allocate a vector in the idt.
+ * @brief Allocate a vector in the idt. The vector is reserved until it is freed
+ * with idt_unregister(), so concurrent callers get different vectors.
  * @return The allocated vector or -1 if no vector was free
  */
 int idt_alloc_vector(void) {
-	for (int i = 0; i < 256; ++i) {
-		if (!handlers[i]) {
-			return i;
-		}
-	}
-
-	return -1;
+	size_t vector = bitmap_alloc_atomic(vectors_used, 256);
+	return vector < 256 ? (int)vector : -1;
 }
 
 /**
@@ -68,17 +86,44 @@ int idt_alloc_vector(void) {
  * @param handler The handler to be registerd.
  */
 void idt_register(uint8_t vector, interrupt_handler handler) {
-	handlers[vector] = handler;
+	bitmap_test_and_set_atomic(vectors_used, vector);
+	rcu_assign_pointer(handlers[vector], handler);
+}
+
+/**
+ * @brief Remove an interrupt handler. Returns once no processor runs the
+ * handler anymore, so its data may be freed afterwards. Must be called from a
+ * thread.
+ * @param vector The vector whose handler should be removed.
+ */
+void idt_unregister(uint8_t vector) {
+	rcu_assign_pointer(handlers[vector], nullptr);
+	synchronize_rcu();
+	bitmap_test_and_clear_atomic(vectors_used, vector);
 }
 
 void interrupt_stub(struct interrupt_frame *frame) {
-	if (handlers[frame->vector] != 0) {
-		handlers[frame->vector](frame);
+	/* Handlers run with irqs disabled, account for that so irq_enable() does
+	 * not enable them before the handler returns */
+	this_cpu_add(irq_disable_count, 1);
+
+	/* Handlers run with irqs disabled, which makes them read-side critical
+	 * sections */
+	this_cpu_add(irq_depth, 1);
+	interrupt_handler handler = rcu_dereference(handlers[frame->vector]);
+	if (handler) {
+		handler(frame);
 	} else {
 		kprintf("An interrupt (vector 0x%w64X) was received, but no handler "
 				"was registered. Ignoring the interrupt\n",
 			frame->vector);
 	}
+	this_cpu_add(irq_depth, -1);
+
+	/* Runs softirqs and may switch threads, which can continue on another
+	 * processor */
+	irq_exit();
+	this_cpu_add(irq_disable_count, -1);
 }
 
 /**
@@ -90,6 +135,13 @@ void idt_init(void) {
 	idt_register_stubs();
 	isr_init();
 
-	lidt(sizeof(idt) - 1, (uint64_t)idt);
+	idt_load();
 	kprint("Initializing and loadingIDT: Success\n");
 }
+
+/**
+ * @brief Load the IDT on the current processor.
+ */
+void idt_load(void) {
+	lidt(sizeof(idt) - 1, (uint64_t)idt);
+}
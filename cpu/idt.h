@@ -3,11 +3,13 @@
 #include <stdint.h>
 
 void idt_init(void);
+void idt_load(void);
 
 int idt_alloc_vector(void);
 
 void irq_enable(void);
 void irq_disable(void);
+void irq_enable_wait(bool mwait);
 
 /**
  * @struct interrupt_frame
@@ -47,3 +49,4 @@ typedef void (*interrupt_handler)(struct interrupt_frame *);
 extern volatile __uint128_t idt[256];
 
 void idt_register(uint8_t vector, interrupt_handler handler);
+void idt_unregister(uint8_t vector);
@@ -3,7 +3,8 @@
 #include "cpu/apic.h"
 #include "cpu/page.h"
 #include "kernel/acpi.h"
-#include "kernel/malloc.h"
+#include "kernel/arena.h"
+#include "kernel/spinlock.h"
 
 #include <stdint.h>
 
@@ -14,6 +15,9 @@ static volatile uint32_t *iowin;
 static uint32_t *isa_to_gsi;
 static uint32_t gsi_max;
 
+/* IOREGSEL and IOWIN are a pair, so accesses must not interleave */
+static struct spinlock ioapic_lock = SPINLOCK_INIT;
+
 #define IOAPICID    (0x00)
 #define IOAPICVER   (0x01)
 #define IOAPICARB   (0x02)
@@ -60,7 +64,7 @@ void ioapic_init(void) {
 
 	/* Handle Interrupt Source Overrides */
 	gsi_max = ioapic_read(IOAPICVER) >> 16;
-	isa_to_gsi = malloc(gsi_max * sizeof(*isa_to_gsi));
+	isa_to_gsi = arena_alloc(gsi_max * sizeof(*isa_to_gsi));
 
 	for (uint32_t i = 0; i < gsi_max; ++i) {
 		isa_to_gsi[i] = i;
@@ -113,8 +117,10 @@ void ioapic_register_interrupt(uint8_t vector, int64_t gsi, uint8_t isa,
 	uint64_t value
 		= (uint64_t)lapic_id << 56 | trigger_mode << 15 | polarity << 13
 	    | delmod << 8 | vector;
+	spin_lock_irqsave(&ioapic_lock);
 	ioapic_write(IOREDTBL(gsi), value & 0xFFFF'FFFF);
 	ioapic_write(IOREDTBL(gsi) + 1, (value >> 32) & 0xFFFF'FFFF);
+	spin_unlock_irqrestore(&ioapic_lock);
 }
 
 /**
@@ -127,7 +133,10 @@ void ioapic_mask(int64_t gsi, uint8_t isa) {
 	if (gsi < 0) {
 		gsi = isa_to_gsi[isa];
 	}
-	ioapic_write(IOREDTBL(gsi), 1 << 16);
+	/* Keep the vector and the mode, so unmasking restores them */
+	spin_lock_irqsave(&ioapic_lock);
+	ioapic_write(IOREDTBL(gsi), ioapic_read(IOREDTBL(gsi)) | 1 << 16);
+	spin_unlock_irqrestore(&ioapic_lock);
 }
 
 /**
@@ -140,5 +149,7 @@ void ioapic_unmask(int64_t gsi, uint8_t isa) {
 	if (gsi < 0) {
 		gsi = isa_to_gsi[isa];
 	}
+	spin_lock_irqsave(&ioapic_lock);
 	ioapic_write(IOREDTBL(gsi), ioapic_read(IOREDTBL(gsi)) & ~(1 << 16));
+	spin_unlock_irqrestore(&ioapic_lock);
 }
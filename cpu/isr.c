@@ -3,7 +3,9 @@
 #include "idt.h"
 #include "x86.h"
 
+#include "kernel/vmem.h"
 #include "util/panic.h"
+#include "util/print.h"
 
 static const char *exception_strings[] = {"Divide-by-Zero-Error Exception",
 	"Debug Exception", "Non-Maskable-Interrupt Exception", "Breakpoint",
@@ -22,6 +24,18 @@ static const char *exception_strings[] = {"Divide-by-Zero-Error Exception",
 }
 
 [[noreturn]] static void page_fault(struct interrupt_frame *frame) {
+	/* The fault may have happened while vmem_lock was held */
+	struct vmem_region region;
+	if (vmem_try_find_region((void *)rcr2(), &region)) {
+		kprintf("Faulting address lies in region 0x%w64X-0x%w64X (flags: "
+				"0x%w64X, backing: %s)\n",
+			(uint64_t)region.start, (uint64_t)region.start + region.size,
+			region.flags,
+			region.backing == VMEM_BACKING_RAM        ? "RAM"
+				: region.backing == VMEM_BACKING_MMIO ? "MMIO"
+													  : "none");
+	}
+
 	panic_frame(frame,
 		"An Error occured:\nError: Page-Fault Exception\nPage fault linear "
 		"address: 0x%w64X\n",
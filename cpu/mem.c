@@ -1,14 +1,18 @@
 #include "mem.h"
 
+#include "idt.h"
 #include "page.h"
+#include "smp.h"
 
+#include "kernel/alloc_prof.h"
 #include "kernel/limine_reqs.h"
+#include "kernel/spinlock.h"
+#include "util/bitmap.h"
 #include "util/panic.h"
 #include "util/print.h"
 #include "util/string.h"
 
 #include <limine.h>
-#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -17,8 +21,25 @@ void *kernel_end = &_kernel_end;
 
 size_t mem_max;
 
-static uint8_t *memmap; /* Map of all of physical memory */
-static size_t memmap_size;
+static uint64_t *memmap; /* Map of all of physical memory, a bit per page */
+static size_t memmap_pages;
+static struct spinlock memmap_lock = SPINLOCK_INIT;
+
+/* Ranges passed to free_pages_deferred(), linked through the higher half
+ * mapping of their first page into a list per processor */
+struct deferred_pages {
+	struct deferred_pages *next;
+	size_t size;
+};
+
+static inline size_t page_index(const void *page) {
+	return (size_t)page / 4'096;
+}
+
+/* Ranges are passed as a size in bytes, rounded up to whole pages */
+static inline size_t page_count(size_t size) {
+	return (size + 4'095) / 4'096;
+}
 
 /**
  * @brief Initialize the physical memory manager.
@@ -37,12 +58,13 @@ void mem_init(void) {
 
 	kprintf("Total amount of memory available: %zu = 0x%zX\n", mem_max,
 		mem_max);
-	memmap_size = mem_max / 4'096 / 8;
+	memmap_pages = mem_max / 4'096;
+	size_t memmap_size = BITMAP_WORDS(memmap_pages) * sizeof(*memmap);
 
 	for (size_t i = 0; i < limine_memmap_response->entry_count; ++i) {
 		if (memmap_entries[i]->type == LIMINE_MEMMAP_USABLE) {
 			if (memmap_entries[i]->length >= memmap_size) {
-				memmap = (uint8_t *)P2V(memmap_entries[i]->base);
+				memmap = (uint64_t *)P2V(memmap_entries[i]->base);
 				break;
 			}
 		}
@@ -53,57 +75,75 @@ void mem_init(void) {
 	}
 
 	/* mark all pages as used */
-	memset(memmap, INT_MAX, memmap_size);
+	memset(memmap, 0xFF, memmap_size);
 
 	/* mark available pages as unused */
 	for (size_t i = 0; i < limine_memmap_response->entry_count; ++i) {
 		if (memmap_entries[i]->type == LIMINE_MEMMAP_USABLE) {
-			for (uint64_t page = memmap_entries[i]->base;
-				page < memmap_entries[i]->base + memmap_entries[i]->length;
-				page += 4'096) {
-				size_t index = page / 4'096 / 8;
-				int bit = page / 4'096 % 8;
-				memmap[index] &= ~(1 << bit);
-			}
+			bitmap_clear_range(memmap,
+				page_index((void *)memmap_entries[i]->base),
+				memmap_entries[i]->length / 4'096);
 		}
 	}
 
 	/* Mark the first MB as used */
-	for (uint64_t page = 0; page < 0x10'0000; page += 4'096) {
-		size_t index = page / 4'096 / 8;
-		int bit = page / 4'096 % 8;
-		memmap[index] |= 1 << bit;
-	}
+	bitmap_set_range(memmap, 0, 0x10'0000 / 4'096);
 
 	/* mark memmap itself as used */
-	for (uint64_t page = (uint64_t)memmap - HIGHER_HALF_BASE;
-		page < (uint64_t)memmap - HIGHER_HALF_BASE + memmap_size;
-		page += 4'096) {
-		size_t index = page / 4'096 / 8;
-		int bit = page / 4'096 % 8;
-		memmap[index] |= 1 << bit;
-	}
+	bitmap_set_range(memmap, page_index(V2P((void *)memmap)),
+		page_count(memmap_size));
 	kprint("Initializing physical memory allocator: Success\n");
 }
 
+/**
+ * @brief Check whether a physical address refers to RAM (as opposed to device
+ * memory or a hole).
+ * @param phys_addr The physical address to check.
+ * @return Whether or not the address is backed by RAM.
+ */
+bool mem_is_ram(const void *phys_addr) {
+	uint64_t phys = (uint64_t)phys_addr;
+	struct limine_memmap_entry **memmap_entries
+		= limine_memmap_response->entries;
+
+	for (size_t i = 0; i < limine_memmap_response->entry_count; ++i) {
+		if (phys < memmap_entries[i]->base
+			|| phys >= memmap_entries[i]->base + memmap_entries[i]->length) {
+			continue;
+		}
+
+		switch (memmap_entries[i]->type) {
+		case LIMINE_MEMMAP_USABLE:
+		case LIMINE_MEMMAP_ACPI_RECLAIMABLE:
+		case LIMINE_MEMMAP_ACPI_NVS:
+		case LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE:
+		case LIMINE_MEMMAP_KERNEL_AND_MODULES:    return true;
+		default:                                  return false;
+		}
+	}
+	return false;
+}
+
 /**
  * @brief Allocate a single page of physical memory.
  * @return The address of a free page in memory.
  */
 void *alloc_page(void) {
-	for (size_t index = 0; index < memmap_size; ++index) {
-		if (~memmap[index] & 0xFF) {
-			for (int bit = 0; bit < 8; ++bit) {
-				if (~memmap[index] & (1 << bit)) {
-					void *page = (void *)(index * 4'096 * 8 + bit * 4'096);
-					mark_page_used(page);
-					return page;
-				}
-			}
-		}
+	drain_deferred_pages();
+
+	spin_lock_irqsave(&memmap_lock);
+	size_t index = bitmap_find_first_zero(memmap, memmap_pages);
+	if (index < memmap_pages) {
+		bitmap_set(memmap, index);
 	}
+	spin_unlock_irqrestore(&memmap_lock);
 
-	return nullptr;
+	if (index == memmap_pages) {
+		return nullptr;
+	}
+	void *page = (void *)(index * 4'096);
+	ALLOC_PROF_RECORD(ALLOC_PAGES, page, 4'096);
+	return page;
 }
 
 /**
@@ -112,24 +152,22 @@ void *alloc_page(void) {
  * @return The address of the allocated range.
  */
 void *alloc_pages(size_t size) {
-	size_t num_pages = size / 4'096;
-	size_t found_free = 0;
-	size_t first_free_idx;
-	for (size_t i = 0; i < memmap_size; ++i) {
-		if (memmap[i] == 0) {
-			++found_free;
-			first_free_idx = found_free ? first_free_idx : i;
-		} else {
-			found_free = 0;
-			first_free_idx = 0;
-		}
+	drain_deferred_pages();
 
-		if (found_free >= num_pages / 8) {
-			mark_pages_used((void *)(i * 8 * 4'096), size);
-			return (void *)(i * 8 * 4'096);
-		}
+	size_t count = page_count(size);
+	spin_lock_irqsave(&memmap_lock);
+	size_t index = bitmap_find_zero_range(memmap, memmap_pages, count);
+	if (index < memmap_pages) {
+		bitmap_set_range(memmap, index, count);
+	}
+	spin_unlock_irqrestore(&memmap_lock);
+
+	if (index == memmap_pages) {
+		return nullptr;
 	}
-	return nullptr;
+	void *pages = (void *)(index * 4'096);
+	ALLOC_PROF_RECORD(ALLOC_PAGES, pages, size);
+	return pages;
 }
 
 /**
@@ -137,9 +175,9 @@ void *alloc_pages(size_t size) {
  * @param page The page to be marked as used.
  */
 void mark_page_used(const void *page) {
-	size_t index = (size_t)page / 4'096 / 8;
-	int bit = (size_t)page / 4'096 % 8;
-	memmap[index] |= 1 << bit;
+	spin_lock_irqsave(&memmap_lock);
+	bitmap_set(memmap, page_index(page));
+	spin_unlock_irqrestore(&memmap_lock);
 }
 
 /**
@@ -148,33 +186,9 @@ void mark_page_used(const void *page) {
  * @param size The size of physical memory to be marked as used.
  */
 void mark_pages_used(const void *pages, size_t size) {
-	size_t index = (size_t)pages / 4'096 / 8;
-	size_t start_bit = (size_t)pages / 4'096 % 8;
-
-	/* Fill bits that do not fill an entire byte */
-	if (start_bit != 0) {
-		for (int bit = start_bit; bit <= 8; ++bit) {
-			memmap[index] |= 1 << bit;
-			--size;
-		}
-		++index;
-	}
-
-	/* Fill entire bytes */
-	while (size > 8) {
-		memmap[index] = UINT8_MAX;
-		++index;
-		size -= 8;
-	}
-
-	/* Fill remaining bits */
-	if (size != 0) {
-		for (int bit = 0; bit < (int)size; ++bit) {
-			memmap[index] |= 1 << bit;
-			--size;
-		}
-		++index;
-	}
+	spin_lock_irqsave(&memmap_lock);
+	bitmap_set_range(memmap, page_index(pages), page_count(size));
+	spin_unlock_irqrestore(&memmap_lock);
 }
 
 /**
@@ -182,9 +196,10 @@ void mark_pages_used(const void *pages, size_t size) {
  * @param page The page to be freed.
  */
 void free_page(void *page) {
-	size_t index = (size_t)page / 4'096 / 8;
-	int bit = (size_t)page / 4'096 % 8;
-	memmap[index] &= ~(1 << bit);
+	ALLOC_PROF_RELEASE(ALLOC_PAGES, page);
+	spin_lock_irqsave(&memmap_lock);
+	bitmap_clear(memmap, page_index(page));
+	spin_unlock_irqrestore(&memmap_lock);
 }
 
 /**
@@ -193,31 +208,62 @@ void free_page(void *page) {
  * @param size The size of the range to be freed.
  */
 void free_pages(void *pages, size_t size) {
-	size_t index = (size_t)pages / 4'096 / 8;
-	size_t start_bit = (size_t)pages / 4'096 % 8;
-
-	/* Fill bits that do not fill an entire byte */
-	if (start_bit != 0) {
-		for (int bit = start_bit; bit <= 8; ++bit) {
-			memmap[index] &= ~(1 << bit);
-			--size;
-		}
-		++index;
-	}
+	ALLOC_PROF_RELEASE(ALLOC_PAGES, pages);
+	spin_lock_irqsave(&memmap_lock);
+	bitmap_clear_range(memmap, page_index(pages), page_count(size));
+	spin_unlock_irqrestore(&memmap_lock);
+}
 
-	/* Fill entire bytes */
-	while (size > 8) {
-		memmap[index] = 0;
-		++index;
-		size -= 8;
+/**
+ * @brief Free a page from a context that must not spend time in the allocator,
+ * i.e. interrupt handlers. The page is queued on the current processor in
+ * constant time and actually freed in a batch by drain_deferred_pages().
+ * @param page The page to be freed.
+ */
+void free_page_deferred(void *page) {
+	free_pages_deferred(page, 4'096);
+}
+
+/**
+ * @brief Free a range of pages from a context that must not spend time in the
+ * allocator.
+ * @param pages The first page to be freed.
+ * @param size The size of the range to be freed.
+ * @see free_page_deferred()
+ */
+void free_pages_deferred(void *pages, size_t size) {
+	struct deferred_pages *entry = P2V((struct deferred_pages *)pages);
+	entry->size = size;
+
+	irq_disable();
+	entry->next = this_cpu_read(deferred_pages);
+	this_cpu_write(deferred_pages, entry);
+	irq_enable();
+}
+
+/**
+ * @brief Free the pages queued on the current processor. Called on every
+ * allocation and by the idle thread, so queued pages are returned even if
+ * nothing allocates.
+ */
+void drain_deferred_pages(void) {
+	if (!this_cpu_read(deferred_pages)) {
+		return;
 	}
 
-	/* Fill remaining bits */
-	if (size != 0) {
-		for (int bit = 0; bit < (int)size; ++bit) {
-			memmap[index] &= ~(1 << bit);
-			--size;
-		}
-		++index;
+	/* Take the whole list at once, pages deferred in the meantime are left for
+	 * the next call */
+	irq_disable();
+	struct deferred_pages *entry = this_cpu_read(deferred_pages);
+	this_cpu_write(deferred_pages, nullptr);
+
+	spin_lock(&memmap_lock);
+	while (entry) {
+		struct deferred_pages *next = entry->next;
+		ALLOC_PROF_RELEASE(ALLOC_PAGES, V2P(entry));
+		bitmap_clear_range(memmap, page_index(V2P(entry)),
+			page_count(entry->size));
+		entry = next;
 	}
+	spin_unlock_irqrestore(&memmap_lock);
 }
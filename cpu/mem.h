@@ -14,6 +14,8 @@ extern size_t mem_max;
 
 void mem_init(void);
 
+bool mem_is_ram(const void *phys_addr);
+
 void *alloc_page(void);
 void *alloc_pages(size_t size);
 
@@ -22,3 +24,7 @@ void mark_pages_used(const void *pages, size_t size);
 
 void free_page(void *page);
 void free_pages(void *pages, size_t size);
+
+void free_page_deferred(void *page);
+void free_pages_deferred(void *pages, size_t size);
+void drain_deferred_pages(void);
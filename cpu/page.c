@@ -4,6 +4,7 @@
 #include "x86.h"
 
 #include "kernel/limine_reqs.h"
+#include "kernel/spinlock.h"
 #include "kernel/vmem.h"
 #include "util/print.h"
 #include "util/string.h"
@@ -24,6 +25,9 @@
 alignas(PAGE_TABLE_ALIGN) static volatile uint64_t pml4_kernel[512];
 volatile uint64_t *pg_pml4 = pml4_kernel;
 
+/* Serializes changes to the kernel's page tables */
+static struct spinlock pg_lock = SPINLOCK_INIT;
+
 static void map_single_page(uint64_t phys, uint64_t virt, uint64_t flags);
 
 /**
@@ -31,10 +35,6 @@ static void map_single_page(uint64_t phys, uint64_t virt, uint64_t flags);
  */
 void pg_init(void) {
 	kprint("Initializing paging...\n");
-	uint64_t cr3
-		= ((uint64_t)&pml4_kernel - KERNEL_BASE
-			  + limine_kernel_address_response->physical_base)
-	    & ADDR_MASK_4K;
 
 	/* Prepare kernel pdp entries in the pml4 that are always mapped */
 	for (int i = PML4_INDEX(HIGHER_HALF_BASE); i < 512; ++i) {
@@ -76,10 +76,19 @@ void pg_init(void) {
 	kprint("Initializing paging: Success\n");
 
 	kprint("Loading CR3...\n");
-	wcr3(cr3);
+	pg_load();
 	kprint("Loading CR3: Success\n");
 }
 
+/**
+ * @brief Load the kernel's page tables on the current processor.
+ */
+void pg_load(void) {
+	wcr3(((uint64_t)&pml4_kernel - KERNEL_BASE
+			 + limine_kernel_address_response->physical_base)
+		& ADDR_MASK_4K);
+}
+
 /**
  * @brief Get the physical address corresponding to a virtual address.
  * @param virt_addr The virtual address to look up.
@@ -165,14 +174,18 @@ static void map_single_page(uint64_t phys, uint64_t virt, uint64_t flags) {
 void *kmap(void *phys_addr, void *virt_addr, size_t size, uint64_t flags) {
 	if (virt_addr == nullptr) {
 		virt_addr = vmem_alloc(size);
+		vmem_set_region(virt_addr, flags,
+			mem_is_ram(phys_addr) ? VMEM_BACKING_RAM : VMEM_BACKING_MMIO);
 	}
 
 	uint64_t phys = (uint64_t)phys_addr;
 	uint64_t virt = (uint64_t)virt_addr;
 
+	spin_lock_irqsave(&pg_lock);
 	for (; virt < (uint64_t)virt_addr + size; phys += 4'096, virt += 4'096) {
 		map_single_page(phys, virt, flags);
 	}
+	spin_unlock_irqrestore(&pg_lock);
 	return virt_addr;
 }
 
@@ -196,9 +209,11 @@ static void unmap_single_page(uint64_t virt) {
  */
 void kunmap(void *virt_addr, size_t size) {
 	uint64_t virt = (uint64_t)virt_addr;
+	spin_lock_irqsave(&pg_lock);
 	for (; virt <= virt + size; virt += 4'096) {
 		unmap_single_page(virt);
 	}
+	spin_unlock_irqrestore(&pg_lock);
 }
 
 volatile uint64_t *alloc_pml4(void) {
@@ -10,6 +10,7 @@
 #define KERNEL_BASE      (limine_kernel_address_response->virtual_base)
 
 #define P2V(addr) ((typeof(addr))((uint64_t)addr + HIGHER_HALF_BASE))
+#define V2P(addr) ((typeof(addr))((uint64_t)addr - HIGHER_HALF_BASE))
 
 #define PAGE_PRESENT (1 << 0)
 #define PAGE_WRITE   (1 << 1)
@@ -23,6 +24,7 @@
 extern volatile uint64_t *pg_pml4;
 
 void pg_init(void);
+void pg_load(void);
 
 void *get_physical_address(const void *virt_addr);
 void set_pml4(volatile uint64_t *pml4);
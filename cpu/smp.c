@@ -0,0 +1,109 @@
+#include "smp.h"
+
+#include "apic.h"
+#include "gdt.h"
+#include "idt.h"
+#include "page.h"
+#include "x86.h"
+
+#include "kernel/limine_reqs.h"
+#include "kernel/proc.h"
+#include "util/print.h"
+
+#include <limine.h>
+#include <stdint.h>
+
+struct cpu cpus[SMP_MAX_CPUS];
+uint32_t cpu_count = 1;
+
+static uint32_t cpus_online = 1;
+
+/* Make cpu the per-processor area of the current processor. KERNEL_GS_BASE is
+ * what swapgs exchanges it with on entry from and exit to user mode. */
+static void set_cpu_area(struct cpu *cpu) {
+	cpu->self = cpu;
+	wrmsr(MSR_IA32_GS_BASE, (uint64_t)cpu);
+	wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
+}
+
+[[noreturn]] static void ap_entry(struct limine_smp_info *info) {
+	struct cpu *cpu = (struct cpu *)info->extra_argument;
+
+	set_cpu_area(cpu);
+	irq_disable();
+	wcr0(CR0_PG | CR0_WP | CR0_NE | CR0_ET | CR0_PE);
+	wcr4(CR4_PGE | CR4_PAE);
+	wrmsr(MSR_IA32_EFER,
+		IA32_EFER_NXE | IA32_EFER_LMA | IA32_EFER_LME | IA32_EFER_SCE);
+
+	gdt_init_ap(cpu->id);
+	idt_load();
+	pg_load();
+	apic_init_ap(cpu->acpi_uid);
+
+	__atomic_add_fetch(&cpus_online, 1, __ATOMIC_RELEASE);
+	irq_enable();
+
+	/* This context becomes the idle thread of the processor */
+	sched_start();
+}
+
+/**
+ * @brief Set up the per-processor area of the BSP. Must be called before
+ * anything else, as even irq_disable() uses it.
+ */
+void smp_init_bsp(void) {
+	set_cpu_area(&cpus[0]);
+}
+
+/**
+ * @brief Start all application processors. Each of them runs its own instance
+ * of the scheduler.
+ */
+void smp_init(void) {
+	kprint("Starting application processors...\n");
+
+	if (!limine_smp_response) {
+		kprint("No SMP information from the bootloader, running on the BSP "
+			   "only\n");
+		return;
+	}
+
+	cpus[0].lapic_id = limine_smp_response->bsp_lapic_id;
+
+	for (uint64_t i = 0; i < limine_smp_response->cpu_count; ++i) {
+		struct limine_smp_info *info = limine_smp_response->cpus[i];
+		if (info->lapic_id == limine_smp_response->bsp_lapic_id) {
+			cpus[0].acpi_uid = info->processor_id;
+			continue;
+		}
+		if (cpu_count == SMP_MAX_CPUS || info->lapic_id > 0xFF) {
+			kprintf("Ignoring processor with Local APIC ID %w32X\n",
+				info->lapic_id);
+			continue;
+		}
+
+		struct cpu *cpu = &cpus[cpu_count];
+		cpu->id = cpu_count++;
+		cpu->lapic_id = info->lapic_id;
+		cpu->acpi_uid = info->processor_id;
+	}
+
+	for (uint32_t id = 1; id < cpu_count; ++id) {
+		for (uint64_t i = 0; i < limine_smp_response->cpu_count; ++i) {
+			struct limine_smp_info *info = limine_smp_response->cpus[i];
+			if (info->lapic_id != cpus[id].lapic_id) {
+				continue;
+			}
+			info->extra_argument = (uint64_t)&cpus[id];
+			__atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+		}
+	}
+
+	while (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) != cpu_count) {
+		pause();
+	}
+
+	kprintf("Starting application processors: Success (%w32u CPUs online)\n",
+		cpu_count);
+}
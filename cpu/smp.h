@@ -0,0 +1,101 @@
+#pragma once
+
+#include "idt.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SMP_MAX_CPUS (64)
+
+struct thread;
+struct deferred_pages;
+struct deferred_block;
+
+/**
+ * @struct cpu
+ * @brief State of a single processor. The IA32_GS_BASE of each processor points
+ * to its own struct cpu, so the members can be accessed with a single %gs
+ * relative instruction, see this_cpu_read(). Every struct cpu starts on its own
+ * cache line.
+ */
+struct cpu {
+	alignas(64) struct cpu *self; /* Read by this_cpu() */
+	uint32_t id; /* Index into cpus, the BSP is always 0 */
+	uint32_t lapic_id;
+	uint32_t acpi_uid;
+	uint64_t irq_disable_count;
+	uint32_t irq_depth; /* Interrupt handlers running, see interrupt_stub() */
+	uint32_t softirq_pending; /* One bit per raised softirq */
+	bool in_softirq; /* Softirqs are running, see irq_exit() */
+	uint64_t preempt_count; /* See preempt_disable() */
+	bool need_resched; /* A switch was deferred by preempt_disable() */
+	uint64_t rcu_qs; /* Quiescent states, counts calls to schedule() */
+	struct thread *current_thread;
+	interrupt_handler timer_handler;
+	uint64_t timer_current; /* Count saved by apic_pause_timer() */
+	bool timer_initialized;
+	/* Frees queued by free_pages_deferred() and free_deferred() on this
+	 * processor, only touched by it with irqs disabled */
+	struct deferred_pages *deferred_pages;
+	struct deferred_block *deferred_blocks;
+};
+
+extern struct cpu cpus[SMP_MAX_CPUS];
+extern uint32_t cpu_count;
+
+/**
+ * @def this_cpu_read(member)
+ * @brief Read a scalar member of the current processor's struct cpu. A single
+ * load, so the result is consistent even if the thread moves to another
+ * processor right after, but only belongs to the processor it runs on if irqs
+ * are disabled.
+ * @param member The name of the member.
+ */
+#define this_cpu_read(member)                                   \
+	({                                                          \
+		typeof(((struct cpu *)nullptr)->member) this_cpu_value; \
+		asm volatile("mov %%gs:%c1, %0"                         \
+			: "=r"(this_cpu_value)                              \
+			: "i"(offsetof(struct cpu, member))                 \
+			: "memory");                                        \
+		this_cpu_value;                                         \
+	})
+
+/**
+ * @def this_cpu_write(member, value)
+ * @brief Write a scalar member of the current processor's struct cpu.
+ * @param member The name of the member.
+ * @param value The value to write.
+ */
+#define this_cpu_write(member, value)                             \
+	asm volatile("mov %1, %%gs:%c0"                               \
+		:                                                         \
+		: "i"(offsetof(struct cpu, member)),                      \
+		"r"((typeof(((struct cpu *)nullptr)->member))(value))     \
+		: "memory")
+
+/**
+ * @def this_cpu_add(member, value)
+ * @brief Add to an integer member of the current processor's struct cpu with a
+ * single instruction, which an irq cannot interrupt halfway.
+ * @param member The name of the member.
+ * @param value The value to add, may be negative.
+ */
+#define this_cpu_add(member, value)                               \
+	asm volatile("add %1, %%gs:%c0"                               \
+		:                                                         \
+		: "i"(offsetof(struct cpu, member)),                      \
+		"r"((typeof(((struct cpu *)nullptr)->member))(value))     \
+		: "cc", "memory")
+
+/**
+ * @brief Get the state of the processor this is running on. Must be called
+ * with irqs disabled if the result is used after a possible reschedule.
+ * @return The current processor.
+ */
+static inline struct cpu *this_cpu(void) {
+	return this_cpu_read(self);
+}
+
+void smp_init_bsp(void);
+void smp_init(void);
@@ -0,0 +1,45 @@
+#include "tsc.h"
+
+#include "x86.h"
+
+#include "util/panic.h"
+#include "util/print.h"
+
+#include <cpuid.h>
+#include <stdint.h>
+
+/* ns = tsc * tsc_mult >> 32, avoids a division on every read */
+static uint64_t tsc_mult;
+
+/**
+ * @brief Determine the frequency of the time stamp counter. The TSC is assumed
+ * to be invariant and synchronized between processors.
+ */
+void tsc_init(void) {
+	kprint("Initializing TSC...\n");
+
+	uint64_t hz;
+	uint32_t eax, ebx, ecx, edx;
+	__cpuid(0x15, eax, ebx, ecx, edx);
+	if (eax && ebx && ecx) {
+		/* The TSC runs at ebx/eax times the core crystal clock (ecx Hz) */
+		hz = (uint64_t)ecx * ebx / eax;
+	} else {
+		__cpuid(0x16, eax, ebx, ecx, edx);
+		if (!eax) {
+			panic("Could not determine TSC frequency.");
+		}
+		hz = (uint64_t)eax * 1'000'000; /* scale eax from MHz to Hz */
+	}
+	tsc_mult = (1'000'000'000ULL << 32) / hz;
+
+	kprintf("Initializing TSC: Success (%w64u Hz)\n", hz);
+}
+
+/**
+ * @brief Get the time since boot.
+ * @return The time in nanoseconds.
+ */
+uint64_t tsc_ns(void) {
+	return (uint64_t)(((__uint128_t)rdtsc() * tsc_mult) >> 32);
+}
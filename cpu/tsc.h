@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+void tsc_init(void);
+uint64_t tsc_ns(void);
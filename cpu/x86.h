@@ -39,6 +39,30 @@ static inline void sti() {
 	asm volatile("hlt");
 }
 
+static inline void pause() {
+	asm volatile("pause");
+}
+
+/* sti only takes effect after the next instruction, so no irq can arrive
+ * before the processor waits */
+static inline void sti_hlt() {
+	asm volatile("sti\n"
+				 "hlt");
+}
+
+static inline void monitor(const volatile void *addr) {
+	asm volatile("monitor"
+		:
+		: "a"(addr), "c"(0), "d"(0));
+}
+
+static inline void sti_mwait() {
+	asm volatile("sti\n"
+				 "mwait"
+		:
+		: "a"(0), "c"(0));
+}
+
 static inline uint8_t inb(uint16_t port) {
 	irq_disable();
 	uint8_t result;
@@ -105,6 +129,9 @@ static inline void __wrmsr(uint32_t msr, uint32_t low, uint32_t high) {
 #define IA32_EFER_LME (1LL << 8)
 #define IA32_EFER_SCE (1LL << 0)
 
+#define MSR_IA32_GS_BASE        (0xC000'0101)
+#define MSR_IA32_KERNEL_GS_BASE (0xC000'0102)
+
 static inline void wrmsr(uint32_t msr, uint64_t val) {
 	uint32_t low = (uint32_t)(val & 0xFFFF'FFFF);
 	uint32_t high = (uint32_t)(val >> 32);
@@ -123,6 +150,13 @@ static inline uint64_t rdmsr(uint32_t msr) {
 	return ((uint64_t)high << 32) | low;
 }
 
+static inline uint64_t rdtsc(void) {
+	uint32_t low, high;
+	asm volatile("rdtsc"
+		: "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
 #define CR0_PG (1LL << 31)
 #define CR0_WP (1LL << 16)
 #define CR0_NE (1LL << 5)
@@ -5,7 +5,7 @@
 
 #include "cpu/mem.h"
 #include "cpu/page.h"
-#include "kernel/malloc.h"
+#include "kernel/arena.h"
 #include "util/panic.h"
 #include "util/print.h"
 #include "util/string.h"
@@ -112,14 +112,13 @@ void nvme_init(struct pci_func *pci_func) {
 		PAGE_PRESENT | PAGE_PCD | PAGE_WRITE | PAGE_GLOBAL);
 
 	/* Initialize internal data structure around submission/completion queues */
-	drive.admin_q.sq = malloc(sizeof(struct nvme_sq));
 	drive.admin_q.sq = kmap(alloc_page(), nullptr, 4'096,
 		PAGE_PRESENT | PAGE_PCD | PAGE_WRITE | PAGE_GLOBAL);
 	drive.admin_q.sq_doorbell = (void *)drive.regs + 0x1000;
 	drive.admin_q.sq_tail = 0;
 	drive.admin_q.sq_size = AQA_ASQS;
 
-	drive.admin_q.cq = malloc(sizeof(struct nvme_cq));
+	drive.admin_q.cq = arena_alloc(sizeof(struct nvme_cq));
 	drive.admin_q.cq->cq = kmap(alloc_page(), nullptr, 4'096,
 		PAGE_PRESENT | PAGE_PCD | PAGE_WRITE | PAGE_GLOBAL);
 	drive.admin_q.cq->cq_doorbell
@@ -185,7 +184,7 @@ void nvme_init(struct pci_func *pci_func) {
 	// TODO: NVMe MSI-X
 
 	/* Create I/O Completion Queue */
-	drive.io_q.cq = malloc(sizeof(struct nvme_cq));
+	drive.io_q.cq = arena_alloc(sizeof(struct nvme_cq));
 	drive.io_q.cq->cq = kmap(alloc_page(), nullptr, 4'096,
 		PAGE_PRESENT | PAGE_PCD | PAGE_WRITE | PAGE_GLOBAL);
 	drive.io_q.cq->cq_doorbell
@@ -205,7 +204,6 @@ void nvme_init(struct pci_func *pci_func) {
 
 
 	/* Create I/O Submission Queue */
-	drive.io_q.sq = malloc(sizeof(struct nvme_sq));
 	drive.io_q.sq = kmap(alloc_page(), nullptr, 4'096,
 		PAGE_PRESENT | PAGE_PCD | PAGE_WRITE | PAGE_GLOBAL);
 	drive.io_q.sq_doorbell
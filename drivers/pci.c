@@ -4,9 +4,11 @@
 
 #include "cpu/page.h"
 #include "kernel/acpi.h"
-#include "kernel/malloc.h"
+#include "kernel/arena.h"
+#include "kernel/rcu.h"
 #include "util/panic.h"
 #include "util/print.h"
+#include "util/radix.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -33,8 +35,25 @@ struct pci_group {
 	uint16_t group_number;
 };
 
+/* Read under RCU. Nodes are initialized before they are published and never
+ * freed, writers are serialized by pci_init(). */
 struct pci_group *pci_tree = nullptr;
 
+/* Indexes of the functions in pci_tree, by address and by the first function
+ * of each type, with the same rules */
+static struct radix_tree pci_by_address = RADIX_TREE_INIT(arena_alloc, nullptr);
+static struct radix_tree pci_by_type = RADIX_TREE_INIT(arena_alloc, nullptr);
+
+static inline uint64_t pci_address_key(uint16_t group, uint8_t bus,
+	uint8_t device, uint8_t function) {
+	return (uint64_t)group << 16 | bus << 8 | device << 3 | function;
+}
+
+static inline uint64_t pci_type_key(uint8_t class, uint8_t subclass,
+	uint8_t prog_if) {
+	return class << 16 | subclass << 8 | prog_if;
+}
+
 static void register_function(struct pci_config_space *config_space,
 	uint16_t group_number, uint8_t bus_number, uint8_t device_number,
 	uint8_t function_number) {
@@ -56,12 +75,11 @@ static void register_function(struct pci_config_space *config_space,
 		}
 	}
 	if (!group) {
-		struct pci_group *temp = pci_tree;
-		pci_tree = malloc(sizeof(struct pci_group));
-		group = pci_tree;
+		group = arena_alloc(sizeof(struct pci_group));
 		group->busses = nullptr;
-		group->next = temp;
+		group->next = pci_tree;
 		group->group_number = group_number;
+		rcu_assign_pointer(pci_tree, group);
 	}
 
 	for (bus = group->busses; bus != nullptr; bus = bus->next) {
@@ -70,13 +88,12 @@ static void register_function(struct pci_config_space *config_space,
 		}
 	}
 	if (!bus) {
-		struct pci_bus *temp = group->busses;
-		group->busses = malloc(sizeof(struct pci_bus));
-		bus = group->busses;
+		bus = arena_alloc(sizeof(struct pci_bus));
 		bus->devices = nullptr;
-		bus->next = temp;
+		bus->next = group->busses;
 		bus->parent = group;
 		bus->bus_number = bus_number;
+		rcu_assign_pointer(group->busses, bus);
 	}
 
 	for (dev = bus->devices; dev != nullptr; dev = dev->next) {
@@ -85,20 +102,16 @@ static void register_function(struct pci_config_space *config_space,
 		}
 	}
 	if (!dev) {
-		struct pci_dev *temp = bus->devices;
-		bus->devices = malloc(sizeof(struct pci_dev));
-		dev = bus->devices;
+		dev = arena_alloc(sizeof(struct pci_dev));
 		dev->functions = nullptr;
-		dev->next = temp;
+		dev->next = bus->devices;
 		dev->parent = bus;
 		dev->device_number = device_number;
+		rcu_assign_pointer(bus->devices, dev);
 	}
 
-	struct pci_func *temp = dev->functions;
-	dev->functions = malloc(sizeof(struct pci_func));
-	func = dev->functions;
-
-	func->next = temp;
+	func = arena_alloc(sizeof(struct pci_func));
+	func->next = dev->functions;
 	func->parent = dev;
 	func->function_number = function_number;
 	func->config_space = config_space;
@@ -106,6 +119,13 @@ static void register_function(struct pci_config_space *config_space,
 	func->class = class;
 	func->subclass = subclass;
 	func->prog_if = prog_if;
+	rcu_assign_pointer(dev->functions, func);
+
+	/* Only fails for the other functions of a type, nodes come from the arena
+	 * which panics when it runs out of memory */
+	radix_insert(&pci_by_address, pci_address_key(group_number, bus_number,
+		device_number, function_number), func);
+	radix_insert(&pci_by_type, pci_type_key(class, subclass, prog_if), func);
 }
 
 static void check_device(struct pci_config_space *config_space,
@@ -196,26 +216,28 @@ void pci_init(void) {
 	kprint("Enumerating PCI devices: Success\n");
 }
 
+/**
+ * @brief Find a PCI function by its type without taking a lock.
+ * @return The first enumerated function of the type or nullptr if there is
+ * none.
+ */
 struct pci_func *pci_get_dev(uint8_t class, uint8_t subclass, uint8_t prog_if) {
-	struct pci_group *group = pci_tree;
-	while (pci_tree) {
-		struct pci_bus *bus = group->busses;
-		while (bus) {
-			struct pci_dev *dev = bus->devices;
-			while (dev) {
-				struct pci_func *func = dev->functions;
-				while (func) {
-					if (func->class == class && func->subclass == subclass
-						&& func->prog_if == prog_if) {
-						return func;
-					}
-					func = func->next;
-				}
-				dev = dev->next;
-			}
-			bus = bus->next;
-		}
-		group = group->next;
-	}
-	return nullptr;
+	rcu_read_lock();
+	struct pci_func *func
+		= radix_lookup(&pci_by_type, pci_type_key(class, subclass, prog_if));
+	rcu_read_unlock();
+	return func;
+}
+
+/**
+ * @brief Find a PCI function by its address without taking a lock.
+ * @return The function or nullptr if there is none at the address.
+ */
+struct pci_func *pci_get_func(uint16_t group, uint8_t bus, uint8_t device,
+	uint8_t function) {
+	rcu_read_lock();
+	struct pci_func *func = radix_lookup(&pci_by_address,
+		pci_address_key(group, bus, device, function));
+	rcu_read_unlock();
+	return func;
 }
@@ -26,3 +26,5 @@ struct pci_func {
 void pci_init(void);
 
 struct pci_func *pci_get_dev(uint8_t class, uint8_t subclass, uint8_t prog_if);
+struct pci_func *pci_get_func(uint16_t group, uint8_t bus, uint8_t device,
+	uint8_t function);
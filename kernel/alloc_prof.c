@@ -0,0 +1,159 @@
+#include "alloc_prof.h"
+
+#ifdef ALLOC_PROFILE
+
+	#include "spinlock.h"
+
+	#include "cpu/idt.h"
+	#include "util/hashtable.h"
+	#include "util/print.h"
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	#define ALLOC_PROF_SIZE (512) /* Must be a power of two */
+
+	#define ALLOC_PROF_LIVE_BITS (13)
+	#define ALLOC_PROF_LIVE      (1 << ALLOC_PROF_LIVE_BITS)
+
+struct alloc_site {
+	void *site;
+	void *parent;
+	enum alloc_kind kind;
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t live_count;
+	uint64_t live_bytes;
+};
+
+/* An allocation that was not freed yet, hashed by its address and kind */
+struct alloc_live {
+	struct hash_node node;
+	struct alloc_site *site;
+	size_t size;
+};
+
+static struct alloc_site sites[ALLOC_PROF_SIZE];
+static uint64_t dropped; /* Allocations that did not fit into the table */
+static struct spinlock prof_lock = SPINLOCK_INIT;
+
+/* The live allocations, never resized. Entries are taken from the pool and
+ * recycled through a free list linked by node.next. */
+static struct alloc_live live_pool[ALLOC_PROF_LIVE];
+static size_t live_pool_used;
+static struct hash_node *live_free;
+static struct hash_node *live_buckets[ALLOC_PROF_LIVE];
+static struct hash_table live = {live_buckets, ALLOC_PROF_LIVE_BITS,
+	ALLOC_PROF_LIVE_BITS, 0, nullptr, nullptr};
+static uint64_t untracked; /* Allocations whose free cannot be attributed */
+
+static inline uint64_t live_key(enum alloc_kind kind, const void *ptr) {
+	/* All allocations are at least 16 byte aligned */
+	return (uint64_t)ptr | kind;
+}
+
+static void live_insert(struct alloc_site *entry, enum alloc_kind kind,
+	const void *ptr, size_t size) {
+	struct alloc_live *alloc;
+	if (live_free) {
+		alloc = hash_entry(live_free, struct alloc_live, node);
+		live_free = live_free->next;
+	} else if (live_pool_used < ALLOC_PROF_LIVE) {
+		alloc = &live_pool[live_pool_used++];
+	} else {
+		++untracked;
+		return;
+	}
+
+	alloc->site = entry;
+	alloc->size = size;
+	hash_insert(&live, &alloc->node, live_key(kind, ptr));
+	++entry->live_count;
+	entry->live_bytes += size;
+}
+
+static const char *kind_strings[] = {"heap", "pages", "vmem"};
+
+/**
+ * @brief Record an allocation. Use ALLOC_PROF_RECORD() instead of calling this
+ * directly.
+ * @param kind The allocator that was used.
+ * @param site The return address into the calling function.
+ * @param parent The return address into the caller's caller, or nullptr.
+ * @param ptr The allocation.
+ * @param size The size of the allocation.
+ */
+void alloc_prof_record(enum alloc_kind kind, void *site, void *parent,
+	const void *ptr, size_t size) {
+	uint64_t key = (uint64_t)site ^ ((uint64_t)parent >> 4) ^ kind;
+	key ^= key >> 17;
+	key *= 0x9E37'79B9'7F4A'7C15;
+
+	spin_lock_irqsave(&prof_lock);
+
+	/* Open addressing with linear probing, entries are never removed */
+	for (size_t i = 0; i < ALLOC_PROF_SIZE; ++i) {
+		struct alloc_site *entry
+			= &sites[(key + i) & (ALLOC_PROF_SIZE - 1)];
+		if (!entry->site) {
+			entry->site = site;
+			entry->parent = parent;
+			entry->kind = kind;
+		} else if (entry->site != site || entry->parent != parent
+				   || entry->kind != kind) {
+			continue;
+		}
+		++entry->count;
+		entry->bytes += size;
+		live_insert(entry, kind, ptr, size);
+		spin_unlock_irqrestore(&prof_lock);
+		return;
+	}
+	++dropped;
+	spin_unlock_irqrestore(&prof_lock);
+}
+
+/**
+ * @brief Record that an allocation was freed. Use ALLOC_PROF_RELEASE() instead
+ * of calling this directly. Allocations that were never recorded are ignored.
+ * @param kind The allocator that was used.
+ * @param ptr The allocation, as returned by the allocator.
+ */
+void alloc_prof_release(enum alloc_kind kind, const void *ptr) {
+	spin_lock_irqsave(&prof_lock);
+	struct hash_node *node = hash_lookup(&live, live_key(kind, ptr));
+	if (node) {
+		struct alloc_live *alloc = hash_entry(node, struct alloc_live, node);
+		--alloc->site->live_count;
+		alloc->site->live_bytes -= alloc->size;
+		hash_remove(&live, node);
+		node->next = live_free;
+		live_free = node;
+	}
+	spin_unlock_irqrestore(&prof_lock);
+}
+
+/**
+ * @brief Print the profile over serial, one line per call site:
+ * "alloc_prof: <kind> <site> <parent> <bytes> <count> <live bytes> <live
+ * count>". The live columns are what was allocated and not freed yet, so sites
+ * whose live bytes keep growing leak. The addresses point into the call
+ * instructions and can be symbolized with `make alloc-prof`.
+ */
+void alloc_prof_dump(void) {
+	kprint("alloc_prof: begin\n");
+	for (size_t i = 0; i < ALLOC_PROF_SIZE; ++i) {
+		struct alloc_site *entry = &sites[i];
+		if (!entry->site) {
+			continue;
+		}
+		kprintf("alloc_prof: %s 0x%w64X 0x%w64X %w64u %w64u %w64u %w64u\n",
+			kind_strings[entry->kind], (uint64_t)entry->site - 1,
+			entry->parent ? (uint64_t)entry->parent - 1 : 0, entry->bytes,
+			entry->count, entry->live_bytes, entry->live_count);
+	}
+	kprintf("alloc_prof: end (%w64u allocations dropped, %w64u not tracked "
+		"until freed)\n", dropped, untracked);
+}
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * @enum alloc_kind
+ * @brief The allocators whose allocations are profiled.
+ */
+enum alloc_kind {
+	ALLOC_HEAP, /* malloc() */
+	ALLOC_PAGES, /* alloc_page(), alloc_pages() */
+	ALLOC_VMEM /* vmem_alloc() */
+};
+
+#ifdef ALLOC_PROFILE
+
+void alloc_prof_record(enum alloc_kind kind, void *site, void *parent,
+	const void *ptr, size_t size);
+void alloc_prof_release(enum alloc_kind kind, const void *ptr);
+void alloc_prof_dump(void);
+
+/**
+ * @def ALLOC_PROF_RECORD(kind, ptr, size)
+ * @brief Attribute a successful allocation to the caller of the allocating
+ * function and the caller's caller. Relies on frame pointers for the latter.
+ */
+	#define ALLOC_PROF_RECORD(kind, ptr, size)                       \
+		alloc_prof_record(kind, __builtin_return_address(0),         \
+			__builtin_frame_address(1) ? __builtin_return_address(1) \
+									   : nullptr,                    \
+			ptr, size)
+
+/**
+ * @def ALLOC_PROF_RELEASE(kind, ptr)
+ * @brief Subtract a freed allocation from the live bytes of its call site.
+ */
+	#define ALLOC_PROF_RELEASE(kind, ptr) alloc_prof_release(kind, ptr)
+
+#else
+
+	#define ALLOC_PROF_RECORD(kind, ptr, size)
+	#define ALLOC_PROF_RELEASE(kind, ptr)
+
+static inline void alloc_prof_dump(void) {}
+
+#endif
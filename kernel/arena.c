@@ -0,0 +1,58 @@
+#include "arena.h"
+
+#include "vmem.h"
+
+#include "cpu/mem.h"
+#include "cpu/page.h"
+#include "util/panic.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Objects allocated during bring-up that live for the entire uptime of the
+ * kernel are placed contiguously into pages by a bump pointer. They carry no
+ * header and can never be freed. */
+
+#define ARENA_ALIGN (16)
+
+static void *arena_ptr; /* Next free byte of the current page */
+static void *arena_end; /* End of the current page */
+
+/**
+ * @brief Allocate memory that is never freed.
+ * @param size The size of the allocation.
+ * @return A pointer to the allocated memory, aligned to 16 bytes.
+ */
+void *arena_alloc(size_t size) {
+	size += (size % ARENA_ALIGN != 0) ? (ARENA_ALIGN - size % ARENA_ALIGN) : 0;
+
+	/* Allocations that don't fit into a page get their own mapping */
+	if (size > 4'096) {
+		void *ptr = vmem_alloc(size);
+		if (!ptr) {
+			panic("Failed to allocate memory (arena)!");
+		}
+		for (size_t offset = 0; offset < size; offset += 4'096) {
+			void *page = alloc_page();
+			if (!page) {
+				panic("Failed to allocate memory (arena)!");
+			}
+			kmap(page, ptr + offset, 4'096,
+				PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL);
+		}
+		return ptr;
+	}
+
+	if ((size_t)(arena_end - arena_ptr) < size) {
+		void *page = alloc_page();
+		if (!page) {
+			panic("Failed to allocate memory (arena)!");
+		}
+		arena_ptr = P2V(page);
+		arena_end = arena_ptr + 4'096;
+	}
+
+	void *ptr = arena_ptr;
+	arena_ptr += size;
+	return ptr;
+}
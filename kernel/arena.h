@@ -0,0 +1,5 @@
+#pragma once
+
+#include <stddef.h>
+
+void *arena_alloc(size_t size);
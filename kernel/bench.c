@@ -0,0 +1,793 @@
+#include "bench.h"
+
+#ifdef BENCH
+
+	#include "fiber.h"
+	#include "lock_stats.h"
+	#include "mutex.h"
+	#include "proc.h"
+	#include "softirq.h"
+	#include "spinlock.h"
+	#include "threaded_irq.h"
+	#include "wait.h"
+	#include "workqueue.h"
+
+	#include "cpu/apic.h"
+	#include "cpu/idt.h"
+	#include "cpu/mem.h"
+	#include "cpu/page.h"
+	#include "cpu/smp.h"
+	#include "cpu/tsc.h"
+	#include "cpu/x86.h"
+	#include "util/print.h"
+	#include "util/ring.h"
+
+	#include <stdint.h>
+
+	#define SWITCH_ROUNDS (100'000)
+	#define TICK_SWITCHES (200)
+
+	#define WAKE_ROUNDS (1'000)
+	#define WAKE_SLEEP  (1'000'000)
+	#define WAKE_HOGS   (2)
+
+	#define FAIR_THREADS  (3)
+	#define FAIR_DURATION (500'000'000)
+
+	#define DL_JOBS     (100)
+	#define DL_WORK     (1'000'000)
+	#define DL_RUNTIME  (2'000'000)
+	#define DL_DEADLINE (5'000'000)
+	#define DL_PERIOD   (10'000'000)
+	#define DL_HOGS     (2)
+
+	#define SPAWN_ROUNDS (1'000)
+
+	#define FIBER_COUNT  (10'000)
+	#define FIBER_YIELDS (100)
+
+	#define LOCK_ROUNDS (100'000)
+
+	#define MUTEX_ROUNDS (1'000'000)
+
+	#define PI_ROUNDS (50)
+	#define PI_HOLD   (2'000'000)
+	#define PI_SLEEP  (5'000'000)
+	#define PI_HOGS   (2)
+	/* With priority inheritance the owner runs until it releases the lock */
+	#define PI_MAX_LATENCY (2 * PI_HOLD)
+
+	#define DEFER_ROUNDS (1'000)
+
+	#define IRQ_ROUNDS (1'000)
+
+	#define RING_ITEMS (1'000'000) /* Per producer */
+	#define RING_SIZE  (1'024)
+	#define RING_BATCH (16)
+
+	#define PAGE_ROUNDS (512)
+	#define PAGE_RANGE  (16) /* Pages */
+
+/* The benchmarks run one after another on the last processor */
+static uint32_t bench_cpu;
+
+/* Number of benchmark threads that have not finished yet */
+static unsigned bench_running;
+static struct wait_queue bench_wq = WAIT_QUEUE_INIT(bench_wq);
+
+static void bench_done(void) {
+	__atomic_sub_fetch(&bench_running, 1, __ATOMIC_RELEASE);
+	wake_all(&bench_wq);
+}
+
+/* Run threads on bench_cpu and wait for all of them to call bench_done(). Each
+ * thread gets its index in funcs as argument. */
+static void bench_run(unsigned count, void (*funcs[])(void *)) {
+	__atomic_store_n(&bench_running, count, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < count; ++i) {
+		kthread_new_on(bench_cpu, funcs[i], (void *)(uint64_t)i);
+	}
+	wait_event(&bench_wq, !__atomic_load_n(&bench_running, __ATOMIC_ACQUIRE));
+}
+
+static bool switch_done;
+
+static void switch_partner(void *) {
+	while (!__atomic_load_n(&switch_done, __ATOMIC_RELAXED)) {
+		sched_yield();
+	}
+	bench_done();
+}
+
+/* Two threads on the same processor yield to each other, every round is two
+ * context switches */
+static void switch_bench(void *) {
+	/* Let the partner start running first */
+	sched_yield();
+
+	uint64_t start = rdtsc();
+	for (unsigned i = 0; i < SWITCH_ROUNDS; ++i) {
+		sched_yield();
+	}
+	uint64_t cycles = rdtsc() - start;
+	__atomic_store_n(&switch_done, true, __ATOMIC_RELAXED);
+
+	kprintf("bench: context switch: %w64u cycles\n",
+		cycles / (2 * SWITCH_ROUNDS));
+	bench_done();
+}
+
+static uint64_t tick_last, tick_max, tick_total;
+static unsigned tick_owner, tick_switches;
+
+/* Two CPU bound threads on the same processor, only the timer interrupt
+ * switches between them. The gap between the last timestamp of one thread and
+ * the first of the other is the whole interrupt driven switch: entry, the
+ * scheduler and the switch itself. This was the only way to switch before
+ * threads were switched on their kernel stacks, so the same loop gives the
+ * baseline figure on older trees. */
+static void tick_bench(void *data) {
+	unsigned self = (unsigned)(uint64_t)data;
+	while (__atomic_load_n(&tick_switches, __ATOMIC_RELAXED) < TICK_SWITCHES) {
+		uint64_t now = rdtsc();
+		if (tick_owner != self) {
+			/* The first switch also includes the start of the thread */
+			if (tick_last) {
+				uint64_t cycles = now - tick_last;
+				tick_max = cycles > tick_max ? cycles : tick_max;
+				tick_total += cycles;
+				++tick_switches;
+			}
+			tick_owner = self;
+		}
+		tick_last = now;
+	}
+
+	if (!self) {
+		kprintf("bench: tick switch: %w64u cycles max, %w64u cycles average\n",
+			tick_max, tick_total / TICK_SWITCHES);
+	}
+	bench_done();
+}
+
+static bool wake_done;
+
+static void wake_hog(void *) {
+	while (!__atomic_load_n(&wake_done, __ATOMIC_RELAXED));
+	bench_done();
+}
+
+/* An interactive thread sleeps repeatedly while CPU hogs compete for the
+ * processor, the latency is the time from its wake_time until it runs */
+static void wake_bench(void *) {
+	uint64_t total = 0, max = 0;
+	for (unsigned i = 0; i < WAKE_ROUNDS; ++i) {
+		uint64_t wake_time = tsc_ns() + WAKE_SLEEP;
+		thread_sleep(WAKE_SLEEP);
+		uint64_t latency = tsc_ns() - wake_time;
+		total += latency;
+		max = latency > max ? latency : max;
+	}
+	__atomic_store_n(&wake_done, true, __ATOMIC_RELAXED);
+
+	kprintf("bench: wake latency: %w64u ns average, %w64u ns max (%u CPU "
+			"hogs)\n",
+		total / WAKE_ROUNDS, max, WAKE_HOGS);
+	bench_done();
+}
+
+static bool fair_done;
+static uint64_t fair_loops[FAIR_THREADS];
+
+static inline uint32_t fair_weight(unsigned i) {
+	return (i + 1) * SCHED_WEIGHT_DEFAULT;
+}
+
+static void fair_hog(void *data) {
+	unsigned i = (uint64_t)data - 1;
+	sched_set_fair(fair_weight(i));
+	while (!__atomic_load_n(&fair_done, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&fair_loops[i], fair_loops[i] + 1, __ATOMIC_RELAXED);
+	}
+	bench_done();
+}
+
+/* Fair threads with different weights spin on the same processor, the share of
+ * loop iterations each of them gets should match its share of the weights */
+static void fair_bench(void *) {
+	/* MLFQ threads preempt fair ones, so this only runs to stop them */
+	thread_sleep(FAIR_DURATION);
+
+	uint64_t loops[FAIR_THREADS], total_loops = 0, total_weight = 0;
+	for (unsigned i = 0; i < FAIR_THREADS; ++i) {
+		loops[i] = __atomic_load_n(&fair_loops[i], __ATOMIC_RELAXED);
+		total_loops += loops[i];
+		total_weight += fair_weight(i);
+	}
+	__atomic_store_n(&fair_done, true, __ATOMIC_RELAXED);
+
+	for (unsigned i = 0; i < FAIR_THREADS; ++i) {
+		kprintf("bench: fair share: weight %w32u got %w64u permille, expected "
+				"%w64u\n",
+			fair_weight(i), loops[i] * 1'000 / (total_loops ? total_loops : 1),
+			fair_weight(i) * 1'000 / total_weight);
+	}
+	bench_done();
+}
+
+static bool dl_done;
+
+static void dl_hog(void *) {
+	while (!__atomic_load_n(&dl_done, __ATOMIC_RELAXED));
+	bench_done();
+}
+
+/* A periodic deadline thread does a fixed amount of work per job while CPU hogs
+ * compete for the processor. The response time is measured from the start of
+ * the period until the job ends. */
+static void dl_bench(void *) {
+	if (!sched_set_deadline(DL_RUNTIME, DL_DEADLINE, DL_PERIOD)) {
+		kprint("bench: deadline: not admitted\n");
+		__atomic_store_n(&dl_done, true, __ATOMIC_RELAXED);
+		bench_done();
+		return;
+	}
+
+	struct thread *self = thread_current();
+	uint64_t misses = sched_deadline_misses();
+	uint64_t max = 0;
+	for (unsigned i = 0; i < DL_JOBS; ++i) {
+		uint64_t period_start = self->abs_deadline - DL_DEADLINE;
+		uint64_t end = tsc_ns() + DL_WORK;
+		while (tsc_ns() < end);
+		uint64_t response = tsc_ns() - period_start;
+		max = response > max ? response : max;
+		sched_wait_period();
+	}
+	__atomic_store_n(&dl_done, true, __ATOMIC_RELAXED);
+
+	kprintf("bench: deadline: %w64u misses in %u jobs, %w64u ns max response "
+			"(%u CPU hogs)\n",
+		sched_deadline_misses() - misses, DL_JOBS, max, DL_HOGS);
+	bench_done();
+}
+
+static bool spawn_done;
+static struct wait_queue spawn_wq = WAIT_QUEUE_INIT(spawn_wq);
+
+static void spawn_worker(void *) {
+	__atomic_store_n(&spawn_done, true, __ATOMIC_RELEASE);
+	wake_all(&spawn_wq);
+}
+
+/* Short-lived threads are created on the same processor one after another and
+ * exit right away, so their stacks come from the cache */
+static void spawn_bench(void *) {
+	uint64_t start = tsc_ns();
+	for (unsigned i = 0; i < SPAWN_ROUNDS; ++i) {
+		__atomic_store_n(&spawn_done, false, __ATOMIC_RELAXED);
+		kthread_new_on(bench_cpu, spawn_worker, nullptr);
+		wait_event(&spawn_wq, __atomic_load_n(&spawn_done, __ATOMIC_ACQUIRE));
+	}
+	uint64_t ns = tsc_ns() - start;
+
+	kprintf("bench: thread lifetime: %w64u ns\n", ns / SPAWN_ROUNDS);
+	bench_done();
+}
+
+static struct fiber_sched fiber_sched;
+
+static void fiber_task(void *) {
+	for (unsigned i = 0; i < FIBER_YIELDS; ++i) {
+		fiber_yield(&fiber_sched);
+	}
+}
+
+/* Many fibers in one thread yield round robin, every yield is one switch */
+static void fiber_bench(void *) {
+	fiber_sched_init(&fiber_sched);
+	unsigned count = 0;
+	while (count < FIBER_COUNT
+		&& fiber_new(&fiber_sched, fiber_task, nullptr)) {
+		++count;
+	}
+
+	uint64_t start = rdtsc();
+	fiber_run(&fiber_sched);
+	uint64_t cycles = rdtsc() - start;
+	fiber_sched_destroy(&fiber_sched);
+
+	if (!count) {
+		kprint("bench: fiber switch: FAIL, no fiber could be created\n");
+		bench_done();
+		return;
+	}
+	/* Every fiber switches away once per yield and once when it returns */
+	kprintf("bench: fiber switch: %w64u cycles (%u fibers)\n",
+		cycles / ((uint64_t)count * (FIBER_YIELDS + 1)), count);
+	bench_done();
+}
+
+enum lock_kind { LOCK_SPIN, LOCK_TICKET, LOCK_MCS, LOCK_MUTEX };
+
+static const char *lock_names[]
+	= {"spinlock", "ticket lock", "MCS lock", "mutex"};
+
+static bool lock_go;
+static uint64_t lock_counter;
+static struct spinlock bench_spinlock = SPINLOCK_INIT;
+static struct ticket_lock bench_ticket_lock = TICKET_LOCK_INIT;
+static struct mcs_lock bench_mcs_lock = MCS_LOCK_INIT;
+static struct mutex bench_mutex = MUTEX_INIT;
+
+static void lock_worker(void *data) {
+	enum lock_kind kind = (uint64_t)data;
+	while (!__atomic_load_n(&lock_go, __ATOMIC_ACQUIRE)) {
+		pause();
+	}
+
+	for (unsigned i = 0; i < LOCK_ROUNDS; ++i) {
+		struct mcs_node node;
+		switch (kind) {
+		case LOCK_SPIN:
+			spin_lock(&bench_spinlock);
+			++lock_counter;
+			spin_unlock(&bench_spinlock);
+			break;
+		case LOCK_TICKET:
+			ticket_lock(&bench_ticket_lock);
+			++lock_counter;
+			ticket_unlock(&bench_ticket_lock);
+			break;
+		case LOCK_MCS:
+			mcs_lock(&bench_mcs_lock, &node);
+			++lock_counter;
+			mcs_unlock(&bench_mcs_lock, &node);
+			break;
+		case LOCK_MUTEX:
+			mutex_lock(&bench_mutex);
+			++lock_counter;
+			mutex_unlock(&bench_mutex);
+			break;
+		}
+	}
+	bench_done();
+}
+
+/* One thread per processor increments a shared counter under each kind of lock
+ * in turn */
+static void lock_bench(enum lock_kind kind) {
+	__atomic_store_n(&bench_running, cpu_count, __ATOMIC_RELAXED);
+	__atomic_store_n(&lock_go, false, __ATOMIC_RELAXED);
+	lock_counter = 0;
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		kthread_new_on(cpu, lock_worker, (void *)(uint64_t)kind);
+	}
+
+	uint64_t start = rdtsc();
+	__atomic_store_n(&lock_go, true, __ATOMIC_RELEASE);
+	wait_event(&bench_wq, !__atomic_load_n(&bench_running, __ATOMIC_ACQUIRE));
+	uint64_t cycles = rdtsc() - start;
+
+	kprintf("bench: %s: %w64u cycles per acquisition (%w32u CPUs)\n",
+		lock_names[kind], cycles / ((uint64_t)LOCK_ROUNDS * cpu_count),
+		cpu_count);
+	if (lock_counter != (uint64_t)LOCK_ROUNDS * cpu_count) {
+		kprintf("bench: %s: lost %w64u increments\n", lock_names[kind],
+			(uint64_t)LOCK_ROUNDS * cpu_count - lock_counter);
+	}
+}
+
+/* Lock and unlock a mutex nobody else uses, next to the same for a spinlock */
+static void mutex_bench(void *) {
+	uint64_t start = rdtsc();
+	for (unsigned i = 0; i < MUTEX_ROUNDS; ++i) {
+		mutex_lock(&bench_mutex);
+		mutex_unlock(&bench_mutex);
+	}
+	uint64_t mutex_cycles = rdtsc() - start;
+
+	start = rdtsc();
+	for (unsigned i = 0; i < MUTEX_ROUNDS; ++i) {
+		spin_lock(&bench_spinlock);
+		spin_unlock(&bench_spinlock);
+	}
+	uint64_t spin_cycles = rdtsc() - start;
+
+	kprintf("bench: uncontended mutex: %w64u cycles per lock and unlock "
+		"(spinlock %w64u)\n", mutex_cycles / MUTEX_ROUNDS,
+		spin_cycles / MUTEX_ROUNDS);
+	bench_done();
+}
+
+static bool pi_enabled;
+static bool pi_done;
+static struct mutex bench_plain_mutex = MUTEX_INIT;
+static struct pi_mutex bench_pi_mutex = PI_MUTEX_INIT(bench_pi_mutex);
+
+static void pi_lock(void) {
+	if (pi_enabled) {
+		pi_mutex_lock(&bench_pi_mutex);
+	} else {
+		mutex_lock(&bench_plain_mutex);
+	}
+}
+
+static void pi_unlock(void) {
+	if (pi_enabled) {
+		pi_mutex_unlock(&bench_pi_mutex);
+	} else {
+		mutex_unlock(&bench_plain_mutex);
+	}
+}
+
+/* CPU bound, so it sinks to the lowest MLFQ level and holds the lock almost
+ * all of the time */
+static void pi_low(void *) {
+	while (!__atomic_load_n(&pi_done, __ATOMIC_RELAXED)) {
+		pi_lock();
+		uint64_t end = tsc_ns() + PI_HOLD;
+		while (tsc_ns() < end);
+		pi_unlock();
+	}
+	bench_done();
+}
+
+static void pi_hog(void *) {
+	while (!__atomic_load_n(&pi_done, __ATOMIC_RELAXED));
+	bench_done();
+}
+
+/* Priority inversion: a thread that mostly sleeps, and thus stays on the
+ * highest level, needs the lock of a CPU bound thread, while CPU hogs on the
+ * same level as the owner compete for the processor. Without priority
+ * inheritance the owner has to wait for the slices of the hogs before it can
+ * release the lock. */
+static void pi_high(void *) {
+	uint64_t max = 0, total = 0;
+	for (unsigned i = 0; i < PI_ROUNDS; ++i) {
+		thread_sleep(PI_SLEEP);
+		uint64_t start = tsc_ns();
+		pi_lock();
+		uint64_t latency = tsc_ns() - start;
+		pi_unlock();
+		max = latency > max ? latency : max;
+		total += latency;
+	}
+	__atomic_store_n(&pi_done, true, __ATOMIC_RELAXED);
+
+	kprintf("bench: priority inversion: %s: %w64u ns max, %w64u ns average "
+			"lock latency (%u ns hold time, %u CPU hogs)\n",
+		pi_enabled ? "pi_mutex" : "mutex", max, total / PI_ROUNDS, PI_HOLD,
+		PI_HOGS);
+	if (pi_enabled && max > PI_MAX_LATENCY) {
+		kprintf("bench: priority inversion: FAIL, pi_mutex latency above %u "
+			"ns\n", PI_MAX_LATENCY);
+	}
+	bench_done();
+}
+
+static void pi_bench(bool enabled) {
+	pi_enabled = enabled;
+	__atomic_store_n(&pi_done, false, __ATOMIC_RELAXED);
+	bench_run(2 + PI_HOGS,
+		(void (*[])(void *)) {pi_high, pi_low, pi_hog, pi_hog});
+}
+
+static uint64_t defer_start, defer_max, defer_total;
+static bool defer_ran;
+static struct wait_queue defer_wq = WAIT_QUEUE_INIT(defer_wq);
+
+static void defer_record(void) {
+	uint64_t latency = tsc_ns() - defer_start;
+	defer_max = latency > defer_max ? latency : defer_max;
+	defer_total += latency;
+	__atomic_store_n(&defer_ran, true, __ATOMIC_RELEASE);
+	wake_all(&defer_wq);
+}
+
+static void defer_tasklet_func(struct tasklet *) {
+	defer_record();
+}
+
+static void defer_work_func(struct work *) {
+	defer_record();
+}
+
+static struct tasklet defer_tasklet = TASKLET_INIT(defer_tasklet_func);
+static struct work defer_work = WORK_INIT(defer_work_func);
+
+/* Time from scheduling a tasklet or queueing work on the system workqueue from
+ * a thread until it runs */
+static void defer_bench(void *) {
+	static const char *names[] = {"tasklet", "workqueue"};
+	for (unsigned kind = 0; kind < 2; ++kind) {
+		defer_max = 0;
+		defer_total = 0;
+		for (unsigned i = 0; i < DEFER_ROUNDS; ++i) {
+			__atomic_store_n(&defer_ran, false, __ATOMIC_RELAXED);
+			defer_start = tsc_ns();
+			if (kind == 0) {
+				tasklet_schedule(&defer_tasklet);
+			} else {
+				schedule_work(&defer_work);
+			}
+			wait_event(&defer_wq,
+				__atomic_load_n(&defer_ran, __ATOMIC_ACQUIRE));
+		}
+		kprintf("bench: %s latency: %w64u ns max, %w64u ns average\n",
+			names[kind], defer_max, defer_total / DEFER_ROUNDS);
+	}
+	bench_done();
+}
+
+static uint64_t irq_start, irq_max, irq_total;
+static bool irq_ran;
+static struct wait_queue irq_wq = WAIT_QUEUE_INIT(irq_wq);
+
+static void irq_func(void *) {
+	uint64_t latency = tsc_ns() - irq_start;
+	irq_max = latency > irq_max ? latency : irq_max;
+	irq_total += latency;
+	__atomic_store_n(&irq_ran, true, __ATOMIC_RELEASE);
+	wake_all(&irq_wq);
+}
+
+/* An IPI has no source to mask */
+static void irq_nop(struct threaded_irq *) {}
+
+/* Time from sending an IPI to the current processor until the threaded handler
+ * of its vector runs */
+static void irq_bench(void *) {
+	int vector = idt_alloc_vector();
+	if (vector < 0) {
+		kprint("bench: threaded irq: no free vector\n");
+		bench_done();
+		return;
+	}
+	struct threaded_irq *irq
+		= threaded_irq_register(vector, irq_func, nullptr, irq_nop, irq_nop);
+
+	for (unsigned i = 0; i < IRQ_ROUNDS; ++i) {
+		__atomic_store_n(&irq_ran, false, __ATOMIC_RELAXED);
+		irq_start = tsc_ns();
+		apic_send_ipi(cpus[bench_cpu].lapic_id, vector);
+		wait_event(&irq_wq, __atomic_load_n(&irq_ran, __ATOMIC_ACQUIRE));
+	}
+	threaded_irq_unregister(irq);
+
+	kprintf("bench: threaded irq latency: %w64u ns max, %w64u ns average\n",
+		irq_max, irq_total / IRQ_ROUNDS);
+	bench_done();
+}
+
+static void *spsc_slots[RING_SIZE];
+static struct mpsc_slot mpsc_slots[RING_SIZE];
+static struct spsc_ring spsc_ring;
+static struct mpsc_queue mpsc_queue;
+static uint32_t ring_batch;
+static unsigned ring_producers;
+static uint64_t ring_errors, ring_missing, ring_cycles;
+
+/* Items carry the index of their producer and a sequence number, so the
+ * consumer can check that none is lost, duplicated or reordered */
+static inline void *ring_item(uint64_t producer, uint64_t seq) {
+	return (void *)(producer << 32 | seq);
+}
+
+static void ring_producer(void *data) {
+	uint64_t producer = (uint64_t)data;
+	void *items[RING_BATCH];
+	for (uint64_t seq = 0; seq < RING_ITEMS;) {
+		uint32_t count = RING_ITEMS - seq < ring_batch ? RING_ITEMS - seq
+		                                               : ring_batch;
+		for (uint32_t i = 0; i < count; ++i) {
+			items[i] = ring_item(producer, seq + i);
+		}
+
+		if (ring_producers == 1) {
+			uint32_t pushed = 0;
+			while ((pushed += spsc_ring_push_batch(&spsc_ring, items + pushed,
+						count - pushed))
+				< count) {
+				pause();
+			}
+		} else {
+			while (!mpsc_queue_push_batch(&mpsc_queue, items, count)) {
+				pause();
+			}
+		}
+		seq += count;
+	}
+	bench_done();
+}
+
+static void ring_consumer(void *) {
+	uint64_t next[SMP_MAX_CPUS] = {};
+	uint64_t expected = (uint64_t)RING_ITEMS * ring_producers;
+	void *items[RING_BATCH];
+
+	uint64_t start = rdtsc();
+	for (uint64_t received = 0; received < expected;) {
+		uint32_t count;
+		if (ring_producers == 1) {
+			count = spsc_ring_pop_batch(&spsc_ring, items, ring_batch);
+		} else {
+			count = mpsc_queue_pop_batch(&mpsc_queue, items, ring_batch);
+		}
+		if (!count) {
+			pause();
+		}
+		for (uint32_t i = 0; i < count; ++i) {
+			uint64_t producer = (uint64_t)items[i] >> 32;
+			uint64_t seq = (uint64_t)items[i] & 0xFFFF'FFFF;
+			if (producer >= ring_producers || seq != next[producer]) {
+				++ring_errors;
+			} else {
+				++next[producer];
+			}
+		}
+		received += count;
+	}
+	ring_cycles = rdtsc() - start;
+
+	/* Out of order items were counted as received in place of these */
+	for (unsigned i = 0; i < ring_producers; ++i) {
+		ring_missing += RING_ITEMS - next[i];
+	}
+	bench_done();
+}
+
+/* Stress and throughput test of the rings in util/ring.h: an SPSC ring between
+ * two processors, or an MPSC queue with a producer on every processor other
+ * than the consumer's */
+static void ring_bench(bool mpsc, uint32_t batch) {
+	uint32_t producer_cpus[SMP_MAX_CPUS];
+	unsigned producers = 0;
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		if (cpu != bench_cpu && (mpsc || !producers)) {
+			producer_cpus[producers++] = cpu;
+		}
+	}
+	if (!producers) {
+		producer_cpus[producers++] = bench_cpu;
+	}
+	/* A single producer always uses the SPSC ring */
+	mpsc = producers > 1;
+
+	ring_batch = batch;
+	ring_producers = producers;
+	ring_errors = 0;
+	ring_missing = 0;
+	spsc_ring_init(&spsc_ring, spsc_slots, RING_SIZE);
+	mpsc_queue_init(&mpsc_queue, mpsc_slots, RING_SIZE);
+
+	__atomic_store_n(&bench_running, 1 + producers, __ATOMIC_RELAXED);
+	kthread_new_on(bench_cpu, ring_consumer, nullptr);
+	for (unsigned i = 0; i < producers; ++i) {
+		kthread_new_on(producer_cpus[i], ring_producer, (void *)(uint64_t)i);
+	}
+	wait_event(&bench_wq, !__atomic_load_n(&bench_running, __ATOMIC_ACQUIRE));
+
+	const char *name = mpsc ? "mpsc queue" : "spsc ring";
+	kprintf("bench: %s: %w64u cycles per item in batches of %w32u (%u "
+			"producers)\n",
+		name, ring_cycles / ((uint64_t)RING_ITEMS * producers), batch,
+		producers);
+	/* Nothing may be left once every item was received */
+	void *item;
+	if (mpsc ? mpsc_queue_pop(&mpsc_queue, &item)
+	         : spsc_ring_pop(&spsc_ring, &item)) {
+		++ring_errors;
+	}
+	if (ring_errors || ring_missing) {
+		kprintf("bench: %s: FAIL, %w64u items out of order, %w64u missing\n",
+			name, ring_errors, ring_missing);
+	}
+}
+
+/* Tags the first and the last word of every allocation with its index, so an
+ * allocation that overlaps another one overwrites a tag. Failed allocations
+ * are counted as errors and set to nullptr. */
+static unsigned page_check(void *pages[], size_t size) {
+	unsigned errors = 0;
+	for (unsigned i = 0; i < PAGE_ROUNDS; ++i) {
+		if (!pages[i] || (uint64_t)pages[i] % 4'096) {
+			++errors;
+			pages[i] = nullptr;
+			continue;
+		}
+		*(uint64_t *)P2V(pages[i]) = i;
+		*(uint64_t *)P2V(pages[i] + size - 8) = i;
+	}
+	for (unsigned i = 0; i < PAGE_ROUNDS; ++i) {
+		if (pages[i] && (*(uint64_t *)P2V(pages[i]) != i
+			|| *(uint64_t *)P2V(pages[i] + size - 8) != i)) {
+			++errors;
+		}
+	}
+	return errors;
+}
+
+/* Allocate a batch of pages and then free it, once page by page and once as
+ * contiguous ranges. The allocations are checked in between, outside of the
+ * measurement. */
+static void page_bench(void *) {
+	static void *pages[PAGE_ROUNDS];
+
+	uint64_t start = rdtsc();
+	for (unsigned i = 0; i < PAGE_ROUNDS; ++i) {
+		pages[i] = alloc_page();
+	}
+	uint64_t page_cycles = rdtsc() - start;
+	unsigned page_errors = page_check(pages, 4'096);
+	start = rdtsc();
+	for (unsigned i = 0; i < PAGE_ROUNDS; ++i) {
+		if (pages[i]) {
+			free_page(pages[i]);
+		}
+	}
+	page_cycles += rdtsc() - start;
+
+	start = rdtsc();
+	for (unsigned i = 0; i < PAGE_ROUNDS; ++i) {
+		pages[i] = alloc_pages(PAGE_RANGE * 4'096);
+	}
+	uint64_t range_cycles = rdtsc() - start;
+	unsigned range_errors = page_check(pages, PAGE_RANGE * 4'096);
+	start = rdtsc();
+	for (unsigned i = 0; i < PAGE_ROUNDS; ++i) {
+		if (pages[i]) {
+			free_pages(pages[i], PAGE_RANGE * 4'096);
+		}
+	}
+	range_cycles += rdtsc() - start;
+
+	kprintf("bench: page allocation: %w64u cycles per page, %w64u per range "
+		"of %u pages\n", page_cycles / PAGE_ROUNDS, range_cycles / PAGE_ROUNDS,
+		PAGE_RANGE);
+	if (page_errors || range_errors) {
+		kprintf("bench: page allocation: FAIL, %u bad pages, %u bad ranges\n",
+			page_errors, range_errors);
+	}
+	bench_done();
+}
+
+static void bench_thread(void *) {
+	bench_run(2, (void (*[])(void *)) {switch_bench, switch_partner});
+	tick_owner = UINT32_MAX;
+	bench_run(2, (void (*[])(void *)) {tick_bench, tick_bench});
+	bench_run(1 + WAKE_HOGS,
+		(void (*[])(void *)) {wake_bench, wake_hog, wake_hog});
+	bench_run(1 + FAIR_THREADS,
+		(void (*[])(void *)) {fair_bench, fair_hog, fair_hog, fair_hog});
+	bench_run(1 + DL_HOGS, (void (*[])(void *)) {dl_bench, dl_hog, dl_hog});
+	bench_run(1, (void (*[])(void *)) {spawn_bench});
+	bench_run(1, (void (*[])(void *)) {fiber_bench});
+	lock_bench(LOCK_SPIN);
+	lock_bench(LOCK_TICKET);
+	lock_bench(LOCK_MCS);
+	bench_run(1, (void (*[])(void *)) {mutex_bench});
+	lock_bench(LOCK_MUTEX);
+	pi_bench(false);
+	pi_bench(true);
+	bench_run(1, (void (*[])(void *)) {defer_bench});
+	bench_run(1, (void (*[])(void *)) {irq_bench});
+	ring_bench(false, 1);
+	ring_bench(false, RING_BATCH);
+	ring_bench(true, 1);
+	ring_bench(true, RING_BATCH);
+	bench_run(1, (void (*[])(void *)) {page_bench});
+	lock_stats_dump();
+}
+
+/**
+ * @brief Start the in-kernel benchmarks. They run in their own threads, on the
+ * last processor, and print their results over serial.
+ */
+void bench_start(void) {
+	bench_cpu = cpu_count - 1;
+	kthread_new(bench_thread, nullptr);
+}
+
+#endif
@@ -0,0 +1,11 @@
+#pragma once
+
+#ifdef BENCH
+
+void bench_start(void);
+
+#else
+
+static inline void bench_start(void) {}
+
+#endif
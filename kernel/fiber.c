@@ -0,0 +1,201 @@
+#include "fiber.h"
+
+#include "proc.h"
+#include "spinlock.h"
+#include "vmem.h"
+
+#include "cpu/idt.h"
+#include "cpu/mem.h"
+#include "cpu/page.h"
+#include "util/list.h"
+#include "util/panic.h"
+
+#include <stdint.h>
+
+/* Includes the struct fiber at its top. Interrupts of the hosting thread and
+ * the softirqs run on their exit are taken on this stack as well. */
+#define FIBER_STACK_SIZE (8'192)
+/* Unmapped page below every stack, an overflow faults instead of corrupting
+ * the memory below */
+#define FIBER_GUARD_SIZE (4'096)
+
+/* Stacks of destroyed schedulers, linked through their lowest word. Like kernel
+ * stacks they are never unmapped, because other processors may still have
+ * them in their TLBs. */
+static void *stack_pool;
+static struct spinlock stack_lock = SPINLOCK_INIT;
+
+struct thread *context_switch(struct thread *prev, void **prev_sp,
+	void *next_sp);
+void fiber_start(void);
+
+/* Only the callee-saved registers are switched, see switch.S */
+static inline void fiber_switch(void **prev_sp, void *next_sp) {
+	context_switch(nullptr, prev_sp, next_sp);
+}
+
+static struct fiber *pop_ready(struct fiber_sched *s) {
+	if (list_empty(&s->ready)) {
+		return nullptr;
+	}
+	struct fiber *f = list_entry(s->ready.next, struct fiber, list);
+	list_del(&f->list);
+	return f;
+}
+
+/* Returns nullptr if no memory is left */
+static void *stack_alloc(void) {
+	spin_lock_irqsave(&stack_lock);
+	void *stack = stack_pool;
+	if (stack) {
+		stack_pool = *(void **)stack;
+	}
+	spin_unlock_irqrestore(&stack_lock);
+	if (stack) {
+		return stack;
+	}
+
+	void *pages = alloc_pages(FIBER_STACK_SIZE);
+	if (!pages) {
+		return nullptr;
+	}
+	void *guard = vmem_alloc(FIBER_GUARD_SIZE + FIBER_STACK_SIZE);
+	if (!guard) {
+		free_pages(pages, FIBER_STACK_SIZE);
+		return nullptr;
+	}
+	vmem_set_region(guard, PAGE_PRESENT | PAGE_WRITE, VMEM_BACKING_RAM);
+	return kmap(pages, guard + FIBER_GUARD_SIZE, FIBER_STACK_SIZE,
+		PAGE_PRESENT | PAGE_WRITE);
+}
+
+static void stack_free(void *stack) {
+	spin_lock_irqsave(&stack_lock);
+	*(void **)stack = stack_pool;
+	stack_pool = stack;
+	spin_unlock_irqrestore(&stack_lock);
+}
+
+/* Called by fiber_start in switch.S when a new fiber runs for the first time */
+[[noreturn]] static void fiber_entry(struct fiber *f) {
+	f->func(f->data);
+
+	/* The stack is put on the free list while it is still in use, but only
+	 * fiber_new() takes it from there and nothing runs before the switch */
+	struct fiber_sched *s = f->sched;
+	--s->count;
+	list_add(&f->list, &s->free);
+	struct fiber *next = pop_ready(s);
+	s->current = next;
+	fiber_switch(&f->sp, next ? next->sp : s->sp);
+	panic("fiber_entry(): an exited fiber was resumed");
+}
+
+/**
+ * @brief Initialize a fiber scheduler without fibers.
+ */
+void fiber_sched_init(struct fiber_sched *s) {
+	init_list_head(&s->ready);
+	init_list_head(&s->free);
+	s->current = nullptr;
+	s->sp = nullptr;
+	s->count = 0;
+}
+
+/**
+ * @brief Release the stacks of all exited fibers for reuse by any scheduler.
+ * Must not be called while any fiber has not returned yet.
+ */
+void fiber_sched_destroy(struct fiber_sched *s) {
+	if (s->count) {
+		panic("fiber_sched_destroy(): fibers are still running");
+	}
+
+	while (!list_empty(&s->free)) {
+		struct fiber *f = list_entry(s->free.next, struct fiber, list);
+		list_del(&f->list);
+		stack_free(f->stack);
+	}
+}
+
+/**
+ * @brief Create a fiber. It first runs once the fibers created before it have
+ * yielded or returned. May also be called by a fiber of the scheduler.
+ * @param s The scheduler to run the fiber.
+ * @param func The function to be executed by the fiber. Can return.
+ * @param data This pointer is passed to the executed function.
+ * @return The fiber or nullptr if no memory is left for its stack. It lives at
+ * the top of its stack, so creating a fiber takes nothing from the heap.
+ */
+struct fiber *fiber_new(struct fiber_sched *s, void (*func)(void *),
+	void *data) {
+	struct fiber *f;
+	if (!list_empty(&s->free)) {
+		f = list_entry(s->free.next, struct fiber, list);
+		list_del(&f->list);
+	} else {
+		void *stack = stack_alloc();
+		if (!stack) {
+			return nullptr;
+		}
+		f = (struct fiber *)(((uint64_t)stack + FIBER_STACK_SIZE
+			- sizeof(struct fiber)) & ~(uint64_t)15);
+		f->stack = stack;
+	}
+
+	f->func = func;
+	f->data = data;
+	f->sched = s;
+
+	/* The initial context restored by fiber_switch(), see switch.S, right
+	 * below the fiber. The stack is 16 byte aligned again once fiber_start is
+	 * entered. */
+	uint64_t *sp = (uint64_t *)f;
+	*--sp = (uint64_t)fiber_start;
+	*--sp = 0; /* rbx */
+	*--sp = 0; /* rbp, terminates the chain of frame pointers */
+	*--sp = (uint64_t)fiber_entry; /* r12 */
+	*--sp = (uint64_t)f; /* r13 */
+	*--sp = 0; /* r14 */
+	*--sp = 0; /* r15 */
+	f->sp = sp;
+
+	list_add_tail(&f->list, &s->ready);
+	++s->count;
+	return f;
+}
+
+/**
+ * @brief Run the fibers of a scheduler in the current thread until all of them
+ * have returned.
+ */
+void fiber_run(struct fiber_sched *s) {
+	if (s->current) {
+		panic("fiber_run(): called by a fiber");
+	}
+
+	struct fiber *next = pop_ready(s);
+	if (!next) {
+		return;
+	}
+	s->current = next;
+	/* Returns when the last fiber returns */
+	fiber_switch(&s->sp, next->sp);
+}
+
+/**
+ * @brief Let the next ready fiber run. The current fiber continues after all
+ * other ready fibers had their turn.
+ * @param s The scheduler of the current fiber.
+ */
+void fiber_yield(struct fiber_sched *s) {
+	struct fiber *f = s->current;
+	struct fiber *next = pop_ready(s);
+	if (!next) {
+		return;
+	}
+
+	list_add_tail(&f->list, &s->ready);
+	s->current = next;
+	fiber_switch(&f->sp, next->sp);
+}
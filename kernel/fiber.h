@@ -0,0 +1,47 @@
+#pragma once
+
+#include "util/list.h"
+
+#include <stddef.h>
+
+struct fiber_sched;
+
+/**
+ * @struct fiber
+ * @brief A cooperative task with an 8 KiB stack above an unmapped guard page.
+ * The fiber itself takes the top of the stack, and interrupts of the hosting
+ * thread, with the softirqs run on their exit, use the rest along with the
+ * fiber. So a fiber should keep well below 4 KiB of stack, overflowing it
+ * faults on the guard page. It only gives up the processor to other fibers of
+ * its fiber_sched in fiber_yield() and when it returns, but the hosting thread
+ * is preempted as usual.
+ */
+struct fiber {
+	struct list_head list; /* Entry in the ready or the free list */
+	void *sp; /* Saved stack pointer while not running */
+	void *stack; /* The lowest address of the stack this fiber lives in */
+	void (*func)(void *);
+	void *data;
+	struct fiber_sched *sched;
+};
+
+/**
+ * @struct fiber_sched
+ * @brief Runs fibers round robin inside the thread that calls fiber_run(). It
+ * is not locked, so only that thread and its fibers may use it.
+ */
+struct fiber_sched {
+	struct list_head ready;
+	struct list_head free; /* Exited fibers, reused with their stacks */
+	struct fiber *current; /* nullptr outside of fiber_run() */
+	void *sp; /* Of the thread inside fiber_run() */
+	size_t count; /* Fibers that have not returned yet */
+};
+
+void fiber_sched_init(struct fiber_sched *s);
+void fiber_sched_destroy(struct fiber_sched *s);
+
+struct fiber *fiber_new(struct fiber_sched *s, void (*func)(void *),
+	void *data);
+void fiber_run(struct fiber_sched *s);
+void fiber_yield(struct fiber_sched *s);
@@ -0,0 +1,106 @@
+#include "futex.h"
+
+#include "proc.h"
+#include "spinlock.h"
+
+#include "cpu/idt.h"
+#include "util/hashtable.h"
+#include "util/list.h"
+
+#include <stdint.h>
+
+#define FUTEX_HASH_BITS (6)
+#define FUTEX_BUCKETS   (1 << FUTEX_HASH_BITS)
+
+/* Threads waiting on any of the addresses that hash to the bucket. Each bucket
+ * has its own cache line, so unrelated addresses rarely contend. */
+struct futex_bucket {
+	alignas(64) struct spinlock lock;
+	struct list_head waiters;
+};
+
+/* Lives on the stack of the waiting thread until it is woken */
+struct futex_waiter {
+	struct list_head list;
+	const uint32_t *addr;
+	struct thread *thread;
+};
+
+static struct futex_bucket buckets[FUTEX_BUCKETS];
+
+static inline struct futex_bucket *futex_bucket(const uint32_t *addr) {
+	return &buckets[hash_u64((uint64_t)addr, FUTEX_HASH_BITS)];
+}
+
+/**
+ * @brief Initialize the wait queues of futex_wait().
+ */
+void futex_init(void) {
+	for (unsigned i = 0; i < FUTEX_BUCKETS; ++i) {
+		buckets[i].lock = (struct spinlock)SPINLOCK_INIT;
+		init_list_head(&buckets[i].waiters);
+	}
+}
+
+/**
+ * @brief Block the current thread until futex_wake() is called on addr, unless
+ * addr no longer holds val. The check and the queueing are atomic with respect
+ * to futex_wake(), so a waker that changes the value first and wakes afterwards
+ * is never missed. May return spuriously, callers check their condition again.
+ * @param addr The address to wait on.
+ * @param val The value addr is expected to hold.
+ * @return Whether the thread blocked, false if the value had changed.
+ */
+bool futex_wait(uint32_t *addr, uint32_t val) {
+	struct futex_bucket *b = futex_bucket(addr);
+
+	spin_lock_irqsave(&b->lock);
+	/* Sequentially consistent, so that callers can announce themselves as
+	 * waiters with a store before it */
+	if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) != val) {
+		spin_unlock_irqrestore(&b->lock);
+		return false;
+	}
+
+	struct thread *t = thread_current();
+	struct futex_waiter waiter = {.addr = addr, .thread = t};
+	list_add_tail(&waiter.list, &b->waiters);
+	__atomic_store_n(&t->state, THREAD_BLOCKED, __ATOMIC_RELAXED);
+	spin_unlock(&b->lock);
+
+	/* futex_wake() has unlinked the waiter before making the thread runnable,
+	 * so it is no longer referenced once this returns */
+	thread_block();
+	irq_enable();
+	return true;
+}
+
+/**
+ * @brief Wake threads blocked in futex_wait() on an address, the longest
+ * waiting first.
+ * @param addr The address the threads wait on.
+ * @param count The maximum number of threads to wake.
+ * @return The number of threads woken.
+ */
+uint32_t futex_wake(uint32_t *addr, uint32_t count) {
+	struct futex_bucket *b = futex_bucket(addr);
+	uint32_t woken = 0;
+
+	spin_lock_irqsave(&b->lock);
+	struct list_head *pos = b->waiters.next;
+	while (pos != &b->waiters && woken < count) {
+		struct futex_waiter *w = list_entry(pos, struct futex_waiter, list);
+		pos = pos->next;
+		if (w->addr != addr) {
+			continue;
+		}
+
+		/* The waiter is gone as soon as its thread runs again */
+		struct thread *t = w->thread;
+		list_del(&w->list);
+		thread_wake(t);
+		++woken;
+	}
+	spin_unlock_irqrestore(&b->lock);
+	return woken;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+void futex_init(void);
+
+bool futex_wait(uint32_t *addr, uint32_t val);
+uint32_t futex_wake(uint32_t *addr, uint32_t count);
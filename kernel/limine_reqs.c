@@ -18,3 +18,6 @@ LIMINE_BASE_REVISION(1)
 
 [[gnu::aligned(8)]] struct limine_kernel_address_request kernel_address_request
 	= {.id = LIMINE_KERNEL_ADDRESS_REQUEST, .revision = 1};
+
+[[gnu::aligned(8)]] struct limine_smp_request smp_request
+	= {.id = LIMINE_SMP_REQUEST, .revision = 0};
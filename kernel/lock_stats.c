@@ -0,0 +1,49 @@
+#include "lock_stats.h"
+
+#ifdef LOCK_STATS
+
+	#include "util/print.h"
+
+	#include <stdint.h>
+
+/* Bounds of the kernel's .data and .bss, defined in linker.ld */
+extern char _data_start[], _kernel_end[];
+
+/* All static locks that were acquired at least once */
+static struct lock_stats *locks;
+
+/**
+ * @brief Add a lock to the dump on its first acquisition. Called by
+ * LOCK_STATS_ACQUIRED() while the lock is held. Only static locks are added,
+ * locks on the heap or on a stack could be freed while still in the list.
+ * @param stats The counters of the lock.
+ */
+void lock_stats_register(struct lock_stats *stats) {
+	stats->registered = true;
+	if ((char *)stats < _data_start || (char *)stats >= _kernel_end) {
+		return;
+	}
+	stats->next = __atomic_load_n(&locks, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&locks, &stats->next, stats, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Print the counters of all static locks over serial, one line per lock:
+ * "lock_stats: <counters> <acquisitions> <contended> <spins> <max hold>", the
+ * hold time in TSC cycles. The counters are read without the locks, so they
+ * may be slightly off. Their addresses lie within the locks and can be
+ * symbolized with `make lock-stats`.
+ */
+void lock_stats_dump(void) {
+	kprint("lock_stats: begin\n");
+	for (struct lock_stats *stats = __atomic_load_n(&locks, __ATOMIC_ACQUIRE);
+		stats; stats = stats->next) {
+		kprintf("lock_stats: 0x%w64X %w64u %w64u %w64u %w64u\n",
+			(uint64_t)stats, stats->acquisitions, stats->contended,
+			stats->spins, stats->max_hold);
+	}
+	kprint("lock_stats: end\n");
+}
+
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#ifdef LOCK_STATS
+
+	#include "cpu/x86.h"
+
+	#include <stdint.h>
+
+/**
+ * @struct lock_stats
+ * @brief Contention counters embedded in every lock. They are only written by
+ * the holder of the lock, so they need no atomics.
+ */
+struct lock_stats {
+	struct lock_stats *next; /* In the list of acquired static locks */
+	bool registered;
+	uint64_t acquisitions;
+	uint64_t contended; /* Acquisitions that had to wait */
+	uint64_t spins; /* Iterations spent waiting */
+	uint64_t max_hold; /* In TSC cycles */
+	uint64_t hold_start;
+};
+
+void lock_stats_register(struct lock_stats *stats);
+void lock_stats_dump(void);
+
+/* Must be called right after the lock was acquired */
+static inline void lock_stats_acquired(struct lock_stats *stats,
+	uint64_t spins) {
+	if (!stats->registered) {
+		lock_stats_register(stats);
+	}
+	++stats->acquisitions;
+	stats->contended += spins != 0;
+	stats->spins += spins;
+	stats->hold_start = rdtsc();
+}
+
+/* Must be called right before the lock is released */
+static inline void lock_stats_released(struct lock_stats *stats) {
+	uint64_t hold = rdtsc() - stats->hold_start;
+	stats->max_hold = hold > stats->max_hold ? hold : stats->max_hold;
+}
+
+/**
+ * @def LOCK_STATS_ACQUIRED(lock, spins)
+ * @brief Count an acquisition of a lock after waiting for spins iterations.
+ */
+	#define LOCK_STATS_ACQUIRED(lock, spins) \
+		lock_stats_acquired(&(lock)->stats, spins)
+
+/**
+ * @def LOCK_STATS_RELEASED(lock)
+ * @brief Record the hold time of a lock that is about to be released.
+ */
+	#define LOCK_STATS_RELEASED(lock) lock_stats_released(&(lock)->stats)
+
+/**
+ * @def LOCK_STATS_INIT
+ * @brief Statically initialize the counters of a lock, appended to the last
+ * initializer of the other members.
+ */
+	#define LOCK_STATS_INIT , {}
+
+#else
+
+	#define LOCK_STATS_ACQUIRED(lock, spins) ((void)(spins))
+	#define LOCK_STATS_RELEASED(lock)
+	#define LOCK_STATS_INIT
+
+static inline void lock_stats_dump(void) {}
+
+#endif
@@ -1,12 +1,21 @@
+#include "alloc_prof.h"
+#include "bench.h"
+#include "futex.h"
+#include "lock_stats.h"
 #include "malloc.h"
 #include "proc.h"
+#include "rcu.h"
+#include "softirq.h"
 #include "vmem.h"
+#include "workqueue.h"
 
 #include "cpu/apic.h"
 #include "cpu/gdt.h"
 #include "cpu/idt.h"
 #include "cpu/mem.h"
 #include "cpu/page.h"
+#include "cpu/smp.h"
+#include "cpu/tsc.h"
 #include "cpu/x86.h"
 #include "drivers/nvme.h"
 #include "drivers/pci.h"
@@ -17,7 +26,7 @@
 
 void func(void) {
 	while (1) {
-		for (unsigned i = 0; i < 10'000'000; ++i);
+		thread_sleep(100'000'000);
 		kprint("\x7");
 	}
 }
@@ -26,6 +35,7 @@ void func(void) {
  * @brief The main kernel function.
  */
 [[noreturn]] void kmain(void) {
+	smp_init_bsp();
 	irq_disable();
 	wcr0(CR0_PG | CR0_WP | CR0_NE | CR0_ET | CR0_PE);
 	wcr4(CR4_PGE | CR4_PAE);
@@ -41,18 +51,26 @@ void func(void) {
 	pg_init();
 	heap_init(kernel_end, 0x4000);
 	vmem_init();
+	tsc_init();
 	apic_init();
 
 	irq_enable();
 
 
+	futex_init();
 	proc_init();
+	rcu_init();
+	smp_init();
+	softirq_init();
+	workqueue_init();
+	bench_start();
 	kthread_new(func, nullptr);
 	kthread_new(func, nullptr);
 
 	kprint("Initializing kernel: Success\n");
+	alloc_prof_dump();
+	lock_stats_dump();
 	sched_start();
-	for (;;);
 
 	pci_init();
 	nvme_init(pci_get_dev(1, 8, 2));
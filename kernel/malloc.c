@@ -1,7 +1,12 @@
 #include "malloc.h"
 
+#include "alloc_prof.h"
+#include "spinlock.h"
+
+#include "cpu/idt.h"
 #include "cpu/mem.h"
 #include "cpu/page.h"
+#include "cpu/smp.h"
 #include "util/panic.h"
 #include "util/print.h"
 #include "util/string.h"
@@ -9,21 +14,36 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Allocated blocks form a list ordered by address, doubly linked so that a
+ * block is removed without searching for its predecessor */
 struct heap_header {
 	size_t size;
 	struct heap_header *next;
-	char data[];
+	struct heap_header *prev;
+	alignas(16) char data[];
 };
 
+/* Virtual memory reserved for the heap behind the kernel, pages are mapped as
+ * the heap grows into it */
+#define HEAP_MAX_SIZE (64 * 1'024 * 1'024)
+
 static void *heap; /* Pointer to the start of the heap */
-static void *heap_end; /* Pointer to the end of the heap */
+static void *heap_end; /* Pointer to the end of the mapped heap */
 static struct heap_header *heap_head; /* Pointer to the first allocated block */
+static struct spinlock heap_lock = SPINLOCK_INIT;
+
+/* Blocks passed to free_deferred(), linked through their data into a list per
+ * processor */
+struct deferred_block {
+	struct deferred_block *next;
+};
 
 /**
  * @brief Initialize the memory manager for calls to malloc() and friends.
  * @param heap_start The linear start address of the heap. Needs to be page
  * aligned.
- * @param size The size of the heap.
+ * @param size The initial size of the heap, it grows on demand up to
+ * HEAP_MAX_SIZE.
  */
 void heap_init(void *heap_start, size_t size) {
 	kprint("Initilizing heap...\n");
@@ -36,7 +56,7 @@ void heap_init(void *heap_start, size_t size) {
 	heap = heap_start;
 	heap_end = heap + size;
 
-	for (void *ptr = heap; ptr <= heap_end; ptr += 4'096) {
+	for (void *ptr = heap; ptr < heap_end; ptr += 4'096) {
 		kmap(alloc_page(), ptr, 4'096, PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL);
 	}
 	memset(heap, 0, size);
@@ -45,42 +65,59 @@ void heap_init(void *heap_start, size_t size) {
 	heap_head = (struct heap_header *)heap_start;
 	heap_head->size = 0;
 	heap_head->next = nullptr;
+	heap_head->prev = nullptr;
 
 	kprint("Initializing heap: Success\n");
 }
 
-void *malloc(size_t size) {
-	if (size > (size_t)(heap_end - heap)) {
+/* Map pages behind the heap until it reaches end, panics if it cannot */
+static void heap_grow(void *end) {
+	if (end > heap + HEAP_MAX_SIZE) {
+		panic("Failed to allocate memory!");
+	}
+	while (heap_end < end) {
+		void *page = alloc_page();
+		if (!page) {
+			panic("Failed to allocate memory!");
+		}
+		kmap(page, heap_end, 4'096, PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL);
+		heap_end += 4'096;
+	}
+}
+
+static void *heap_alloc(size_t size) {
+	if (size > HEAP_MAX_SIZE) {
 		panic("Failed to allocate memory!");
 	}
 	struct heap_header *current = heap_head;
 	/* first use of malloc, nothing has been allocated yet */
 	if (current->size == 0) {
+		heap_grow(heap + size + sizeof(struct heap_header));
 		current->size = size + sizeof(struct heap_header);
 		current->next = nullptr;
+		current->prev = nullptr;
 		return (void *)current->data;
 	}
 	/* is the block between heap and the first allocated block big enough? */
 	if ((size_t)((void *)heap_head - heap)
 		>= size + sizeof(struct heap_header)) {
 		current = (struct heap_header *)heap;
-		current->size = size;
+		current->size = size + sizeof(struct heap_header);
 		current->next = heap_head;
+		current->prev = nullptr;
+		heap_head->prev = current;
 		heap_head = current;
 		return (void *)current->data;
 	}
 	do {
 		/* have we reached the end of the heap? */
 		if (current->next == nullptr) {
-			/* the heap is not big enough */
-			if ((void *)current->next + size > heap_end) {
-				panic("Failed to allocate memory!"); /* Failed allocations
-				                                        aren't handled anyway
-				                                        right now */
-			}
+			heap_grow((void *)current + current->size + size
+				+ sizeof(struct heap_header));
 			current->next
 				= (struct heap_header *)((void *)current + current->size);
 			current->next->next = nullptr;
+			current->next->prev = current;
 			current->next->size = size + sizeof(struct heap_header);
 			return (void *)current->next->data;
 		}
@@ -94,30 +131,105 @@ void *malloc(size_t size) {
 	current->next = (struct heap_header *)((void *)current + current->size);
 	current->next->size = size + sizeof(struct heap_header);
 	current->next->next = temp;
-	return (void *)current->data;
+	current->next->prev = current;
+	temp->prev = current->next;
+	return (void *)current->next->data;
+}
+
+static void heap_free(void *ptr) {
+	/* the pointer points to the data of the block which is preceded by a
+	 * heap_header */
+	struct heap_header *block = ptr - sizeof(struct heap_header);
+	if (block->prev ? block->prev->next != block : heap_head != block) {
+		panic("free(): 0x%w64X was not allocated", (uint64_t)ptr);
+	}
+
+	if (block->next) {
+		block->next->prev = block->prev;
+	}
+	if (block->prev) {
+		block->prev->next = block->next;
+	} else if (block->next) {
+		heap_head = block->next;
+	} else {
+		/* the last block was freed, start over with a block of size 0 */
+		heap_head = (struct heap_header *)heap;
+		heap_head->size = 0;
+		heap_head->next = nullptr;
+		heap_head->prev = nullptr;
+	}
+}
+
+void *malloc(size_t size) {
+	drain_deferred_blocks();
+
+	/* Keep blocks aligned and large enough to be linked by free_deferred() */
+	size += (size % 16 != 0) ? (16 - size % 16) : 0;
+	size = size ? size : 16;
+
+	spin_lock_irqsave(&heap_lock);
+	void *ptr = heap_alloc(size);
+	spin_unlock_irqrestore(&heap_lock);
+
+	if (ptr) {
+		ALLOC_PROF_RECORD(ALLOC_HEAP, ptr, size);
+	}
+	return ptr;
 }
 
 void free(void *ptr) {
 	if (ptr == nullptr) {
 		return;
 	}
-	/* the pointer points to the data of the block which is preceded by a
-	 * heap_header */
-	ptr -= sizeof(struct heap_header);
-	struct heap_header *current = heap_head;
+	ALLOC_PROF_RELEASE(ALLOC_HEAP, ptr);
 
-	/* should we free the first block? */
-	if (heap_head == ptr) {
-		heap_head = heap_head->next;
+	spin_lock_irqsave(&heap_lock);
+	heap_free(ptr);
+	spin_unlock_irqrestore(&heap_lock);
+}
+
+/**
+ * @brief Free a block from a context that must not spend time in the allocator,
+ * i.e. interrupt handlers. The block is queued on the current processor in
+ * constant time and actually freed in a batch by drain_deferred_blocks().
+ * @param ptr The block to free.
+ */
+void free_deferred(void *ptr) {
+	if (ptr == nullptr) {
 		return;
 	}
-	while (current->next != nullptr) {
-		if ((void *)current->next == ptr) {
-			current->next = current->next->next;
-			return;
-		}
-		current = current->next;
+
+	struct deferred_block *block = ptr;
+	irq_disable();
+	block->next = this_cpu_read(deferred_blocks);
+	this_cpu_write(deferred_blocks, block);
+	irq_enable();
+}
+
+/**
+ * @brief Free the blocks queued on the current processor. Called by malloc()
+ * and by the idle thread, so queued blocks are returned even if nothing
+ * allocates.
+ */
+void drain_deferred_blocks(void) {
+	if (!this_cpu_read(deferred_blocks)) {
+		return;
 	}
+
+	/* Take the whole list at once, blocks deferred in the meantime are left for
+	 * the next call */
+	irq_disable();
+	struct deferred_block *block = this_cpu_read(deferred_blocks);
+	this_cpu_write(deferred_blocks, nullptr);
+
+	spin_lock(&heap_lock);
+	while (block) {
+		struct deferred_block *next = block->next;
+		ALLOC_PROF_RELEASE(ALLOC_HEAP, block);
+		heap_free(block);
+		block = next;
+	}
+	spin_unlock_irqrestore(&heap_lock);
 }
 
 void *realloc(void *ptr, size_t size) {
@@ -125,17 +237,24 @@ void *realloc(void *ptr, size_t size) {
 		return malloc(size);
 	}
 
+	/* Resize in place if the block still ends before the next one */
 	struct heap_header *header = ptr - sizeof(*header);
-	if ((header->next == nullptr
-			&& ((uint64_t)header + size) < (uint64_t)heap_end)
-		|| ((uint64_t)header + size) < (uint64_t)header->next) {
-		header->size = size;
+	size_t block_size = size + (size % 16 != 0 ? 16 - size % 16 : 0)
+		+ sizeof(*header);
+	spin_lock_irqsave(&heap_lock);
+	void *limit = header->next ? (void *)header->next : heap_end;
+	bool fits = (void *)header + block_size <= limit;
+	if (fits) {
+		header->size = block_size;
+	}
+	spin_unlock_irqrestore(&heap_lock);
+	if (fits) {
 		return ptr;
 	}
 
 	void *new_ptr = malloc(size);
 	if (new_ptr) {
-		memcpy(new_ptr, ptr, header->size);
+		memcpy(new_ptr, ptr, header->size - sizeof(*header));
 		free(ptr);
 	}
 	return new_ptr;
@@ -5,4 +5,6 @@
 void heap_init(void *heap_start, size_t heap_size);
 void *malloc(size_t size);
 void free(void *ptr);
+void free_deferred(void *ptr);
+void drain_deferred_blocks(void);
 void *realloc(void *ptr, size_t size);
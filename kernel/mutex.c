@@ -0,0 +1,281 @@
+#include "mutex.h"
+
+#include "futex.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#include "cpu/idt.h"
+#include "cpu/smp.h"
+#include "cpu/x86.h"
+#include "util/list.h"
+
+#include <stdint.h>
+
+/* How often a waiter checks a locked mutex before it blocks. Roughly the cost
+ * of blocking and being woken again. */
+#define MUTEX_SPINS (200)
+
+/* Serializes the slow paths of all pi_mutexes, their waiters and the priority
+ * inheritance chains through them */
+static struct spinlock pi_lock = SPINLOCK_INIT;
+
+/* Lives on the stack of the waiting thread until it is handed the mutex */
+struct pi_waiter {
+	struct list_head list;
+	struct thread *thread;
+};
+
+/* Acquire a mutex by blocking. It is left MUTEX_CONTENDED, because other
+ * threads may still be blocked on it. */
+static void mutex_lock_contended(struct mutex *m) {
+	while (__atomic_exchange_n(&m->state, MUTEX_CONTENDED, __ATOMIC_ACQUIRE)
+		!= MUTEX_UNLOCKED) {
+		futex_wait(&m->state, MUTEX_CONTENDED);
+	}
+}
+
+/**
+ * @brief Acquire a mutex that was locked when mutex_lock() tried. Called by
+ * mutex_lock() only.
+ * @param m The mutex to acquire.
+ */
+void mutex_lock_slow(struct mutex *m) {
+	/* Spinning pays off if the owner runs on another processor and is about
+	 * to unlock. It does not if other waiters already gave up and blocked. */
+	if (cpu_count > 1) {
+		for (unsigned i = 0; i < MUTEX_SPINS; ++i) {
+			uint32_t state = __atomic_load_n(&m->state, __ATOMIC_RELAXED);
+			if (state == MUTEX_CONTENDED) {
+				break;
+			}
+			if (state == MUTEX_UNLOCKED && mutex_trylock(m)) {
+				return;
+			}
+			pause();
+		}
+	}
+	mutex_lock_contended(m);
+}
+
+/**
+ * @brief Wake a waiter of a mutex that was just released. Called by
+ * mutex_unlock() only.
+ * @param m The released mutex.
+ */
+void mutex_unlock_slow(struct mutex *m) {
+	futex_wake(&m->state, 1);
+}
+
+/**
+ * @brief Release a mutex and block until the condition variable is signaled,
+ * then acquire the mutex again. May return spuriously, so the condition has to
+ * be checked in a loop.
+ * @param cv The condition variable.
+ * @param m The mutex protecting the condition, held by the caller.
+ */
+void condvar_wait(struct condvar *cv, struct mutex *m) {
+	uint32_t seq = __atomic_load_n(&cv->seq, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cv->waiters, 1, __ATOMIC_SEQ_CST);
+	mutex_unlock(m);
+
+	/* A signal after the load above changed seq, so it is not missed */
+	futex_wait(&cv->seq, seq);
+	__atomic_sub_fetch(&cv->waiters, 1, __ATOMIC_RELAXED);
+	mutex_lock_contended(m);
+}
+
+/**
+ * @brief Wake one thread waiting on a condition variable.
+ * @param cv The condition variable.
+ */
+void condvar_signal(struct condvar *cv) {
+	__atomic_add_fetch(&cv->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cv->waiters, __ATOMIC_SEQ_CST)) {
+		futex_wake(&cv->seq, 1);
+	}
+}
+
+/**
+ * @brief Wake all threads waiting on a condition variable.
+ * @param cv The condition variable.
+ */
+void condvar_broadcast(struct condvar *cv) {
+	__atomic_add_fetch(&cv->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cv->waiters, __ATOMIC_SEQ_CST)) {
+		futex_wake(&cv->seq, UINT32_MAX);
+	}
+}
+
+/**
+ * @brief Decrement a semaphore if it is not zero.
+ * @param sem The semaphore.
+ * @return Whether it was decremented.
+ */
+bool sem_trydown(struct semaphore *sem) {
+	uint32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while (count) {
+		if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, true,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Decrement a semaphore, blocking while it is zero.
+ * @param sem The semaphore.
+ */
+void sem_down(struct semaphore *sem) {
+	while (!sem_trydown(sem)) {
+		/* sem_up() increments the count before it checks for waiters, so
+		 * either it sees this waiter or futex_wait() sees the new count */
+		__atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+		futex_wait(&sem->count, 0);
+		__atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Increment a semaphore and wake a thread blocked in sem_down().
+ * @param sem The semaphore.
+ */
+void sem_up(struct semaphore *sem) {
+	__atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST)) {
+		futex_wake(&sem->count, 1);
+	}
+}
+
+/**
+ * @brief Initialize an unlocked pi_mutex.
+ * @param m The mutex to initialize.
+ */
+void pi_mutex_init(struct pi_mutex *m) {
+	m->owner = 0;
+	init_list_head(&m->waiters);
+	init_list_head(&m->held);
+}
+
+static inline struct thread *pi_owner(struct pi_mutex *m) {
+	uintptr_t owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+	return (struct thread *)(owner & ~(uintptr_t)PI_MUTEX_WAITERS);
+}
+
+/* The waiter with the highest priority, the longest waiting one among equals.
+ * Must be called with pi_lock held and a waiter queued. */
+static struct pi_waiter *pi_top_waiter(struct pi_mutex *m) {
+	struct pi_waiter *top = nullptr;
+	uint8_t top_level = UINT8_MAX;
+	struct list_head *pos;
+	list_for_each(pos, &m->waiters) {
+		struct pi_waiter *w = list_entry(pos, struct pi_waiter, list);
+		uint8_t level = sched_pi_level(w->thread);
+		if (!top || level < top_level) {
+			top = w;
+			top_level = level;
+		}
+	}
+	return top;
+}
+
+/* Recompute the priority a thread inherits from the waiters of the mutexes it
+ * holds, and pass a change on along the chain of mutexes it waits for. The walk
+ * stops where nothing changes, which also ends it in a deadlock cycle. Must be
+ * called with pi_lock held. */
+static void pi_update(struct thread *t) {
+	while (t) {
+		uint8_t level = UINT8_MAX;
+		struct list_head *pos;
+		list_for_each(pos, &t->pi_held) {
+			struct pi_mutex *m = list_entry(pos, struct pi_mutex, held);
+			uint8_t top = sched_pi_level(pi_top_waiter(m)->thread);
+			level = top < level ? top : level;
+		}
+		if (level == t->pi_level) {
+			return;
+		}
+		sched_set_pi_level(t, level);
+
+		struct pi_mutex *next = t->pi_blocked_on;
+		t = next ? pi_owner(next) : nullptr;
+	}
+}
+
+/**
+ * @brief Wait for a pi_mutex that was locked when pi_mutex_lock() tried.
+ * Called by pi_mutex_lock() only.
+ * @param m The mutex to acquire.
+ */
+void pi_mutex_lock_slow(struct pi_mutex *m) {
+	struct thread *self = thread_current();
+	struct pi_waiter waiter = {.thread = self};
+
+	spin_lock_irqsave(&pi_lock);
+	uintptr_t owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+	for (;;) {
+		/* Mutexes are handed to waiters, so an unowned one has none */
+		if (!owner) {
+			if (__atomic_compare_exchange_n(&m->owner, &owner,
+					(uintptr_t)self, false, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED)) {
+				spin_unlock_irqrestore(&pi_lock);
+				return;
+			}
+			continue;
+		}
+		/* Makes the fast path of pi_mutex_unlock() fail from now on */
+		if (owner & PI_MUTEX_WAITERS
+			|| __atomic_compare_exchange_n(&m->owner, &owner,
+				owner | PI_MUTEX_WAITERS, false, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	if (list_empty(&m->waiters)) {
+		list_add(&m->held, &pi_owner(m)->pi_held);
+	}
+	list_add_tail(&waiter.list, &m->waiters);
+	self->pi_blocked_on = m;
+	pi_update(pi_owner(m));
+
+	/* pi_mutex_unlock_slow() makes this thread the owner before it wakes it */
+	while (pi_owner(m) != self) {
+		__atomic_store_n(&self->state, THREAD_BLOCKED, __ATOMIC_RELAXED);
+		spin_unlock(&pi_lock);
+		thread_block();
+		spin_lock(&pi_lock);
+	}
+	spin_unlock_irqrestore(&pi_lock);
+}
+
+/**
+ * @brief Hand a pi_mutex to its highest ranked waiter. Called by
+ * pi_mutex_unlock() only, when the mutex has waiters.
+ * @param m The mutex to release.
+ */
+void pi_mutex_unlock_slow(struct pi_mutex *m) {
+	struct thread *self = thread_current();
+
+	spin_lock_irqsave(&pi_lock);
+	struct pi_waiter *top = pi_top_waiter(m);
+	struct thread *next = top->thread;
+	list_del(&top->list);
+	list_del(&m->held);
+	next->pi_blocked_on = nullptr;
+
+	uintptr_t owner = (uintptr_t)next;
+	if (!list_empty(&m->waiters)) {
+		list_add(&m->held, &next->pi_held);
+		owner |= PI_MUTEX_WAITERS;
+	}
+	__atomic_store_n(&m->owner, owner, __ATOMIC_RELEASE);
+
+	/* The new owner inherits from the remaining waiters before it runs, this
+	 * thread drops what it inherited through the mutex */
+	pi_update(next);
+	pi_update(self);
+	thread_wake(next);
+	spin_unlock_irqrestore(&pi_lock);
+}
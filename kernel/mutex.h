@@ -0,0 +1,167 @@
+#pragma once
+
+#include "cpu/smp.h"
+#include "util/list.h"
+
+#include <stdint.h>
+
+/* Sleeping locks for threads. Their uncontended paths are a single atomic
+ * operation and never leave the header, waiters block with futex_wait() or,
+ * for the pi_mutex, on the mutex itself. None of them may be used in irq
+ * handlers or with preemption disabled. */
+
+enum mutex_state {
+	MUTEX_UNLOCKED,
+	MUTEX_LOCKED,
+	MUTEX_CONTENDED /* Locked, and threads may be blocked on it */
+};
+
+/**
+ * @struct mutex
+ * @brief A lock whose waiters spin briefly and then block.
+ */
+struct mutex {
+	uint32_t state;
+};
+
+/**
+ * @def MUTEX_INIT
+ * @brief Statically initialize an unlocked mutex.
+ */
+#define MUTEX_INIT {MUTEX_UNLOCKED}
+
+void mutex_lock_slow(struct mutex *m);
+void mutex_unlock_slow(struct mutex *m);
+
+/**
+ * @brief Try to acquire a mutex without waiting.
+ * @param m The mutex to acquire.
+ * @return Whether the mutex was acquired.
+ */
+static inline bool mutex_trylock(struct mutex *m) {
+	uint32_t expected = MUTEX_UNLOCKED;
+	return __atomic_compare_exchange_n(&m->state, &expected, MUTEX_LOCKED,
+		false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Acquire a mutex, blocking if it stays locked for long.
+ * @param m The mutex to acquire.
+ */
+static inline void mutex_lock(struct mutex *m) {
+	if (!mutex_trylock(m)) {
+		mutex_lock_slow(m);
+	}
+}
+
+/**
+ * @brief Release a mutex and wake one of its waiters, if there are any.
+ * @param m The mutex to release.
+ */
+static inline void mutex_unlock(struct mutex *m) {
+	if (__atomic_exchange_n(&m->state, MUTEX_UNLOCKED, __ATOMIC_RELEASE)
+		== MUTEX_CONTENDED) {
+		mutex_unlock_slow(m);
+	}
+}
+
+/**
+ * @struct condvar
+ * @brief Lets threads wait for a condition protected by a mutex.
+ */
+struct condvar {
+	uint32_t seq; /* Changed by every signal */
+	uint32_t waiters;
+};
+
+/**
+ * @def CONDVAR_INIT
+ * @brief Statically initialize a condition variable.
+ */
+#define CONDVAR_INIT {0, 0}
+
+void condvar_wait(struct condvar *cv, struct mutex *m);
+void condvar_signal(struct condvar *cv);
+void condvar_broadcast(struct condvar *cv);
+
+/**
+ * @struct semaphore
+ * @brief A counter that threads block on while it is zero.
+ */
+struct semaphore {
+	uint32_t count;
+	uint32_t waiters;
+};
+
+/**
+ * @def SEMAPHORE_INIT(count)
+ * @brief Statically initialize a semaphore.
+ * @param count The initial count.
+ */
+#define SEMAPHORE_INIT(count) {(count), 0}
+
+bool sem_trydown(struct semaphore *sem);
+void sem_down(struct semaphore *sem);
+void sem_up(struct semaphore *sem);
+
+/**
+ * @struct pi_mutex
+ * @brief A mutex with priority inheritance: while threads wait for it, its
+ * owner runs with the priority of the highest ranked of them, and so does the
+ * owner of a mutex that owner waits for in turn. Waiters block right away and
+ * the mutex is handed to the highest ranked one.
+ */
+struct pi_mutex {
+	uintptr_t owner; /* The owning thread, PI_MUTEX_WAITERS while it has any */
+	struct list_head waiters; /* The highest ranked is handed the mutex */
+	struct list_head held; /* Entry in the pi_held list of the owner */
+};
+
+#define PI_MUTEX_WAITERS (1)
+
+/**
+ * @def PI_MUTEX_INIT(name)
+ * @brief Statically initialize an unlocked pi_mutex.
+ */
+#define PI_MUTEX_INIT(name) \
+	{0, LIST_HEAD_INIT((name).waiters), LIST_HEAD_INIT((name).held)}
+
+void pi_mutex_init(struct pi_mutex *m);
+void pi_mutex_lock_slow(struct pi_mutex *m);
+void pi_mutex_unlock_slow(struct pi_mutex *m);
+
+/**
+ * @brief Try to acquire a pi_mutex without waiting.
+ * @param m The mutex to acquire.
+ * @return Whether the mutex was acquired.
+ */
+static inline bool pi_mutex_trylock(struct pi_mutex *m) {
+	uintptr_t expected = 0;
+	return __atomic_compare_exchange_n(&m->owner, &expected,
+		(uintptr_t)this_cpu_read(current_thread), false, __ATOMIC_ACQUIRE,
+		__ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Acquire a pi_mutex, lending the priority of the current thread to the
+ * owners on the way while blocked.
+ * @param m The mutex to acquire.
+ */
+static inline void pi_mutex_lock(struct pi_mutex *m) {
+	if (!pi_mutex_trylock(m)) {
+		pi_mutex_lock_slow(m);
+	}
+}
+
+/**
+ * @brief Release a pi_mutex, handing it to its highest ranked waiter and
+ * dropping the priority inherited from its waiters.
+ * @param m The mutex to release.
+ */
+static inline void pi_mutex_unlock(struct pi_mutex *m) {
+	uintptr_t expected = (uintptr_t)this_cpu_read(current_thread);
+	if (!__atomic_compare_exchange_n(&m->owner, &expected, 0, false,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		pi_mutex_unlock_slow(m);
+	}
+}
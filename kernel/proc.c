@@ -1,106 +1,1225 @@
 #include "proc.h"
 
+#include "arena.h"
 #include "malloc.h"
+#include "rcu.h"
+#include "softirq.h"
+#include "spinlock.h"
 
+#include "cpu/apic.h"
 #include "cpu/apic_timer.h"
-#include "cpu/gdt.h"
 #include "cpu/idt.h"
 #include "cpu/mem.h"
 #include "cpu/page.h"
+#include "cpu/smp.h"
+#include "cpu/tsc.h"
 #include "cpu/x86.h"
 #include "util/list.h"
+#include "util/panic.h"
 #include "util/print.h"
+#include "util/radix.h"
+#include "util/rbtree.h"
 
+#include <cpuid.h>
 #include <stdint.h>
 
-#define KSTACK_SIZE (4 * 4'096)
-#define THREAD_TIME (1'000'000)
+#define KSTACK_SIZE  (4 * 4'096)
+#define KSTACK_CACHE (8) /* Stacks kept by each processor */
+#define THREAD_TIME (1'000'000) /* Slice of the highest level */
 
+/* Multi-level feedback queue: level 0 has the highest priority, each level
+ * below doubles the slice */
+#define MLFQ_LEVELS (4)
+#define MLFQ_BOOST  (100'000'000)
+
+/* Lower ranks preempt higher ones: deadline threads rank above all MLFQ levels,
+ * fair threads below them */
+#define RANK_DEADLINE (0)
+#define RANK_MLFQ     (1) /* Of level 0 */
+#define RANK_FAIR     (RANK_MLFQ + MLFQ_LEVELS)
+#define RANK_IDLE     (RANK_FAIR + 1)
+
+/* Fair share class: every queued fair thread runs once per FAIR_LATENCY */
+#define FAIR_LATENCY   (6'000'000)
+#define FAIR_MIN_SLICE (750'000)
+
+/* Deadline class: bandwidths are runtime / period as fixed point fractions of a
+ * processor. Admission leaves a share for the other classes. */
+#define DL_BW_SHIFT (20)
+#define DL_BW_MAX   ((95ULL << DL_BW_SHIFT) / 100)
+
+/* Bounds for a single timer in tickless mode */
+#define TIMER_MIN (10'000)
+#define TIMER_MAX (1'000'000'000)
+
+/* Read under rcu_read_lock(), processes are never freed yet */
 static struct list_head proc_list = LIST_HEAD_INIT(proc_list);
-static struct list_head thread_list = LIST_HEAD_INIT(thread_list);
+/* Processes by id. Ids are handed out in order, so the tree stays shallow */
+static struct radix_tree proc_ids = RADIX_TREE_INIT(malloc, free);
+/* Serializes writers of proc_list, proc_ids and the thread lists of all
+ * processes */
+static struct spinlock proc_lock = SPINLOCK_INIT;
+
+/* Exited threads whose stacks are no longer in use, freed by reap_threads() */
+static struct thread *dead_threads;
+
+/**
+ * @struct kstack_cache
+ * @brief Kernel stacks of exited threads that are still mapped, so creating a
+ * thread on the same processor takes one from here instead of allocating and
+ * mapping pages. Only accessed by its processor with irqs disabled.
+ */
+struct kstack_cache {
+	alignas(64) unsigned count;
+	void *stacks[KSTACK_CACHE];
+};
+
+static struct kstack_cache kstack_caches[SMP_MAX_CPUS];
 
-static struct proc *current_proc;
-static struct thread *current_thread;
+/* Stacks that did not fit in a cache, linked through their lowest word. Stacks
+ * are never unmapped, because other processors may still have them in their
+ * TLBs. */
+static void *kstack_pool;
+static struct spinlock kstack_lock = SPINLOCK_INIT;
+
+/**
+ * @struct runqueue
+ * @brief The runnable threads of a processor: SCHED_DEADLINE threads in a tree
+ * ordered by their absolute deadline, SCHED_MLFQ threads in one queue per level
+ * and SCHED_FAIR threads in a tree ordered by vruntime. The earliest deadline
+ * runs first, then the owner takes threads from the head of the highest level
+ * and queues preempted ones at the tail, fair threads only run if no other
+ * thread is runnable. Other processors steal the lowest ranked threads, but
+ * deadline threads are pinned to the processor that admitted them.
+ */
+struct runqueue {
+	alignas(64) struct spinlock lock;
+	struct rb_root dl_tree;
+	uint64_t dl_bw; /* Admitted bandwidth of the deadline threads pinned here */
+	struct list_head levels[MLFQ_LEVELS];
+	uint32_t level_map; /* Bit n is set if levels[n] is not empty */
+	struct rb_root fair_tree;
+	uint64_t fair_weight; /* Sum of the weights in fair_tree */
+	uint64_t min_vruntime; /* Only increases, places new fair threads */
+	uint64_t nr_queued; /* Read without the lock for load estimates */
+	struct list_head sleepers; /* Sorted by wake_time */
+	uint64_t next_boost; /* When all queued threads go back to level 0 */
+	bool ticking; /* Whether the running thread will be preempted */
+	uint8_t current_rank; /* Of the running thread */
+	uint64_t current_deadline; /* Of the running thread, if it has one */
+	uint32_t kick; /* Set by rq_kick(), monitored by the idle thread */
+};
+
+static struct runqueue runqueues[SMP_MAX_CPUS];
+
+/* Processors waiting in their idle thread, one bit per processor */
+static uint64_t idle_cpus;
+static bool use_mwait;
+static uint8_t resched_vector;
+
+/* The context that called sched_start() on a processor, run when there is
+ * nothing else to do */
+static struct thread idle_threads[SMP_MAX_CPUS];
 
 static struct proc *kproc;
 
+/* Jobs of all deadline threads that ended after their deadline */
+static uint64_t dl_misses;
+
 static uint64_t last_thread_id = 0;
 
-static struct thread *next_thread(struct thread *current) {
-	return current ? list_next_circular(current, thread_list, &thread_list)
-	               : list_entry(thread_list.next, struct thread, thread_list);
+static inline bool is_idle(const struct thread *t) {
+	return t >= idle_threads && t < idle_threads + SMP_MAX_CPUS;
+}
+
+/* The time a thread may run on a level before it is demoted */
+static inline uint64_t level_slice(uint8_t level) {
+	return (uint64_t)THREAD_TIME << level;
+}
+
+/* Whether a thread runs on an MLFQ level above its own, because it holds a
+ * pi_mutex that a higher ranked thread waits for */
+static inline bool is_boosted(const struct thread *t) {
+	if (t->policy == SCHED_DEADLINE) {
+		return false;
+	}
+	uint8_t level = t->policy == SCHED_MLFQ ? t->level : MLFQ_LEVELS;
+	return t->pi_level < level;
+}
+
+/* The MLFQ level a thread is queued on */
+static inline uint8_t queue_level(const struct thread *t) {
+	return is_boosted(t) ? t->pi_level : t->level;
+}
+
+static inline uint8_t rank(const struct thread *t) {
+	if (is_idle(t)) {
+		return RANK_IDLE;
+	}
+	if (is_boosted(t)) {
+		return RANK_MLFQ + t->pi_level;
+	}
+	switch (t->policy) {
+	case SCHED_DEADLINE:
+		return RANK_DEADLINE;
+	case SCHED_FAIR:
+		return RANK_FAIR;
+	default:
+		return RANK_MLFQ + t->level;
+	}
+}
+
+/* Must be called with rq->lock held */
+static void dl_insert(struct runqueue *rq, struct thread *t) {
+	struct rb_node **link = &rq->dl_tree.node, *parent = nullptr;
+	while (*link) {
+		parent = *link;
+		struct thread *other = rb_entry(parent, struct thread, tree_node);
+		link = t->abs_deadline < other->abs_deadline ? &parent->left
+		                                             : &parent->right;
+	}
+	rb_link_node(&t->tree_node, parent, link);
+	rb_insert(&rq->dl_tree, &t->tree_node, nullptr);
+}
+
+/* Must be called with rq->lock held */
+static void fair_insert(struct runqueue *rq, struct thread *t) {
+	struct rb_node **link = &rq->fair_tree.node, *parent = nullptr;
+	while (*link) {
+		parent = *link;
+		struct thread *other = rb_entry(parent, struct thread, tree_node);
+		/* Equal keys go right, so they run in FIFO order */
+		link = t->vruntime < other->vruntime ? &parent->left : &parent->right;
+	}
+	rb_link_node(&t->tree_node, parent, link);
+	rb_insert(&rq->fair_tree, &t->tree_node, nullptr);
+	rq->fair_weight += t->weight;
+}
+
+/* min_vruntime follows the smallest vruntime of the running and the queued
+ * fair threads. Must be called with rq->lock held. */
+static void fair_update_min(struct runqueue *rq, struct thread *current) {
+	uint64_t min = UINT64_MAX;
+	if (!is_idle(current) && current->policy == SCHED_FAIR) {
+		min = current->vruntime;
+	}
+	if (rq->fair_tree.node) {
+		struct thread *first
+			= rb_entry(rb_first(&rq->fair_tree), struct thread, tree_node);
+		min = first->vruntime < min ? first->vruntime : min;
+	}
+	if (min != UINT64_MAX && min > rq->min_vruntime) {
+		rq->min_vruntime = min;
+	}
+}
+
+/* The slice of a fair thread is its share of FAIR_LATENCY. Must be called with
+ * rq->lock held. */
+static uint64_t fair_slice(struct runqueue *rq, struct thread *t) {
+	uint64_t slice = FAIR_LATENCY * t->weight / (rq->fair_weight + t->weight);
+	return slice < FAIR_MIN_SLICE ? FAIR_MIN_SLICE : slice;
 }
 
-static void switch_context(struct interrupt_frame *frame) {
-	if (current_thread) {
-		*(current_thread->regs) = *frame;
+static inline uint64_t rq_load(uint32_t cpu) {
+	uint64_t load
+		= __atomic_load_n(&runqueues[cpu].nr_queued, __ATOMIC_RELAXED);
+	struct thread *current
+		= __atomic_load_n(&cpus[cpu].current_thread, __ATOMIC_RELAXED);
+	return load + (current && !is_idle(current));
+}
+
+/* Must be called with rq->lock held */
+static void rq_add(struct runqueue *rq, struct thread *t) {
+	if (t->policy == SCHED_DEADLINE) {
+		dl_insert(rq, t);
+	} else if (t->policy == SCHED_FAIR && !is_boosted(t)) {
+		fair_insert(rq, t);
+	} else {
+		uint8_t level = queue_level(t);
+		list_add_tail(&t->run_list, &rq->levels[level]);
+		rq->level_map |= 1 << level;
 	}
+	t->queued = true;
+	__atomic_store_n(&rq->nr_queued, rq->nr_queued + 1, __ATOMIC_RELAXED);
+}
 
-	current_thread = next_thread(current_thread);
-	current_proc = current_thread->proc;
+/* Must be called with rq->lock held */
+static void rq_del(struct runqueue *rq, struct thread *t) {
+	if (t->policy == SCHED_DEADLINE) {
+		rb_erase(&rq->dl_tree, &t->tree_node, nullptr);
+	} else if (t->policy == SCHED_FAIR && !is_boosted(t)) {
+		rb_erase(&rq->fair_tree, &t->tree_node, nullptr);
+		rq->fair_weight -= t->weight;
+	} else {
+		uint8_t level = queue_level(t);
+		list_del(&t->run_list);
+		if (list_empty(&rq->levels[level])) {
+			rq->level_map &= ~(1 << level);
+		}
+	}
+	t->queued = false;
+	__atomic_store_n(&rq->nr_queued, rq->nr_queued - 1, __ATOMIC_RELAXED);
+}
 
-	set_pml4(current_thread->proc->pml4);
-	*frame = *(current_thread->regs);
+/* Place a thread that blocked or slept. Must be called with rq->lock held. */
+static void place_woken(struct runqueue *rq, struct thread *t) {
+	if (t->policy == SCHED_DEADLINE) {
+		/* Constant bandwidth server: the thread keeps its deadline only if
+		 * the rest of its budget fits before it at the admitted bandwidth,
+		 * otherwise it starts a new job with a full budget. This also
+		 * replenishes throttled threads at their next period. */
+		uint64_t now = tsc_ns();
+		if (t->budget <= 0 || now >= t->abs_deadline
+			|| ((uint64_t)t->budget << DL_BW_SHIFT)
+			/ (t->abs_deadline - now) > t->dl_bw) {
+			t->abs_deadline = now + t->dl_deadline;
+			t->budget = t->dl_runtime;
+		}
+	} else if (t->policy == SCHED_FAIR) {
+		/* Give a little credit for sleeping, but not enough to monopolize
+		 * the processor */
+		uint64_t min = rq->min_vruntime - FAIR_LATENCY / 2;
+		if (rq->min_vruntime > FAIR_LATENCY / 2 && t->vruntime < min) {
+			t->vruntime = min;
+		}
+	} else if (t->level > 0 && t->runtime < level_slice(t->level) / 2) {
+		/* It blocked before it used up half of its slice, so it is
+		 * interactive and moves up a level */
+		--t->level;
+		t->runtime = 0;
+	}
+}
 
-	apic_set_timer(THREAD_TIME, switch_context, APIC_TIMER_ONE_SHOT);
+/* Returns whether the owner has to be kicked to notice the thread, because it
+ * runs without a tick or the thread should preempt the running one */
+static bool rq_enqueue(struct runqueue *rq, struct thread *t, bool woken) {
+	spin_lock(&rq->lock);
+	if (woken) {
+		place_woken(rq, t);
+	}
+	rq_add(rq, t);
+	bool kick = !rq->ticking || rank(t) < rq->current_rank
+	         || (rank(t) == RANK_DEADLINE && rq->current_rank == RANK_DEADLINE
+	             && t->abs_deadline < rq->current_deadline);
+	rq->ticking = true;
+	spin_unlock(&rq->lock);
+	return kick;
+}
+
+/* Queue a thread in the sleepers list by its wake_time. Must be called with
+ * rq->lock held. */
+static void rq_add_sleeper(struct runqueue *rq, struct thread *t) {
+	struct list_head *pos;
+	list_for_each(pos, &rq->sleepers) {
+		struct thread *other = list_entry(pos, struct thread, run_list);
+		if (other->wake_time > t->wake_time) {
+			break;
+		}
+	}
+	/* Insert before pos */
+	list_add_tail(&t->run_list, pos);
+	__atomic_store_n(&t->state, THREAD_SLEEPING, __ATOMIC_RELAXED);
+}
+
+/* Park a deadline thread that used up its budget until its next period starts,
+ * place_woken() replenishes it. The job cannot end before its deadline anymore.
+ * Must be called with rq->lock held. */
+static void dl_throttle(struct runqueue *rq, struct thread *t, uint64_t now) {
+	uint64_t next_period = t->abs_deadline - t->dl_deadline + t->dl_period;
+	t->wake_time = next_period > now ? next_period : now;
+	++t->dl_misses;
+	__atomic_add_fetch(&dl_misses, 1, __ATOMIC_RELAXED);
+	rq_add_sleeper(rq, t);
+}
+
+/* Make all sleepers whose wake_time has passed runnable. Must be called with
+ * rq->lock held. */
+static void rq_wake_sleepers(struct runqueue *rq, uint64_t now) {
+	while (!list_empty(&rq->sleepers)) {
+		struct thread *t
+			= list_entry(rq->sleepers.next, struct thread, run_list);
+		if (t->wake_time > now) {
+			break;
+		}
+		list_del(&t->run_list);
+		__atomic_store_n(&t->state, THREAD_READY, __ATOMIC_RELAXED);
+		place_woken(rq, t);
+		rq_add(rq, t);
+	}
+}
+
+/* Move all queued MLFQ threads to the highest level, so CPU bound threads do
+ * not starve. Fair threads that are only queued on a level because of an
+ * inherited priority stay. Must be called with rq->lock held. */
+static void rq_boost(struct runqueue *rq) {
+	for (uint8_t level = 1; level < MLFQ_LEVELS; ++level) {
+		struct list_head *head = &rq->levels[level];
+		for (struct list_head *pos = head->next; pos != head;) {
+			struct thread *t = list_entry(pos, struct thread, run_list);
+			pos = pos->next;
+			if (t->policy != SCHED_MLFQ) {
+				continue;
+			}
+			rq_del(rq, t);
+			t->level = 0;
+			t->runtime = 0;
+			rq_add(rq, t);
+		}
+	}
+}
+
+/* Take the deadline thread with the earliest deadline, the first thread of the
+ * highest level, or the fair thread with the smallest vruntime */
+static struct thread *rq_dequeue(struct runqueue *rq) {
+	struct thread *t = nullptr;
+	spin_lock(&rq->lock);
+	if (rq->dl_tree.node) {
+		t = rb_entry(rb_first(&rq->dl_tree), struct thread, tree_node);
+	} else if (rq->level_map) {
+		struct list_head *level = &rq->levels[__builtin_ctz(rq->level_map)];
+		t = list_entry(level->next, struct thread, run_list);
+	} else if (rq->fair_tree.node) {
+		t = rb_entry(rb_first(&rq->fair_tree), struct thread, tree_node);
+	}
+	if (t) {
+		rq_del(rq, t);
+	}
+	spin_unlock(&rq->lock);
+	return t;
+}
+
+/* Boosted threads stay, they would have to leave the level they are queued on
+ * with their inherited priority */
+static inline bool can_steal(struct thread *t) {
+	return !t->pinned && !is_boosted(t)
+	    && !__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE);
+}
+
+/* Take the lowest ranked thread of another processor's queue that is no longer
+ * running anywhere and may migrate: the fair thread with the largest vruntime,
+ * or the newest thread of the lowest level. The vruntime of a fair thread is
+ * returned relative to the queue's min_vruntime. */
+static struct thread *rq_steal(struct runqueue *rq) {
+	struct thread *t = nullptr;
+	spin_lock(&rq->lock);
+	for (struct rb_node *node = rb_last(&rq->fair_tree); node;
+		node = rb_prev(node)) {
+		struct thread *candidate = rb_entry(node, struct thread, tree_node);
+		if (can_steal(candidate)) {
+			t = candidate;
+			rq_del(rq, t);
+			t->vruntime -= rq->min_vruntime;
+			break;
+		}
+	}
+	for (int level = MLFQ_LEVELS - 1; level >= 0 && !t; --level) {
+		struct list_head *head = &rq->levels[level];
+		for (struct list_head *pos = head->prev; pos != head; pos = pos->prev) {
+			struct thread *candidate = list_entry(pos, struct thread, run_list);
+			if (can_steal(candidate)) {
+				t = candidate;
+				rq_del(rq, t);
+				break;
+			}
+		}
+	}
+	spin_unlock(&rq->lock);
+	return t;
+}
+
+/* Steal from the busiest other processor */
+static struct thread *steal_thread(uint32_t self) {
+	uint32_t victim = self;
+	uint64_t max_queued = 0;
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		uint64_t queued
+			= __atomic_load_n(&runqueues[cpu].nr_queued, __ATOMIC_RELAXED);
+		if (cpu != self && queued > max_queued) {
+			victim = cpu;
+			max_queued = queued;
+		}
+	}
+	return victim == self ? nullptr : rq_steal(&runqueues[victim]);
+}
+
+static uint32_t least_loaded_cpu(void) {
+	uint32_t target = 0;
+	uint64_t min_load = UINT64_MAX;
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		uint64_t load = rq_load(cpu);
+		if (load < min_load) {
+			target = cpu;
+			min_load = load;
+		}
+	}
+	return target;
+}
+
+struct thread *context_switch(struct thread *prev, void **prev_sp,
+	void *next_sp);
+void thread_start(void);
+
+static void sched_tick(struct interrupt_frame *frame);
+
+/* Make a processor schedule soon. Must be called with irqs disabled. */
+static void rq_kick(uint32_t cpu) {
+	struct cpu *self = this_cpu();
+	if (cpu == self->id) {
+		/* The idle thread notices new threads after the current irq, a
+		 * running thread is interrupted as soon as possible. Before
+		 * sched_start() there is nothing to do either. */
+		struct thread *current = self->current_thread;
+		if (current && !is_idle(current)) {
+			apic_set_timer(TIMER_MIN, sched_tick, APIC_TIMER_ONE_SHOT);
+		}
+		return;
+	}
+
+	/* The write alone wakes a processor that waits with mwait */
+	__atomic_store_n(&runqueues[cpu].kick, 1, __ATOMIC_SEQ_CST);
+	if (!use_mwait
+		|| !(__atomic_load_n(&idle_cpus, __ATOMIC_SEQ_CST) & (1ULL << cpu))) {
+		apic_send_ipi(cpus[cpu].lapic_id, resched_vector);
+	}
+}
+
+/* Program the timer of the current processor for the next thread. Tickless:
+ * the thread is only preempted at the end of its slice if another one waits in
+ * the queue, otherwise the timer only fires for the earliest sleeper. The
+ * budget of a deadline thread is always enforced. */
+static void rq_set_timer(struct runqueue *rq, struct thread *next,
+	uint64_t now) {
+	spin_lock(&rq->lock);
+	rq->current_rank = rank(next);
+	rq->current_deadline = next->abs_deadline;
+	fair_update_min(rq, next);
+
+	uint64_t timeout = UINT64_MAX;
+	if (rq->current_rank == RANK_DEADLINE) {
+		/* Only deadline threads with an earlier deadline preempt it, they
+		 * kick the processor when they are queued */
+		rq->ticking = true;
+		timeout = next->budget > TIMER_MIN ? (uint64_t)next->budget : TIMER_MIN;
+	} else {
+		/* Queued fair threads cannot preempt an MLFQ thread */
+		rq->ticking = rq->level_map
+		           || (rq->current_rank >= RANK_FAIR && rq->fair_tree.node);
+		if (rq->ticking && rq->current_rank == RANK_FAIR) {
+			timeout = fair_slice(rq, next);
+		} else if (rq->ticking) {
+			uint64_t slice = level_slice(queue_level(next));
+			timeout = next->runtime < slice ? slice - next->runtime : TIMER_MIN;
+		}
+	}
+	if (!list_empty(&rq->sleepers)) {
+		uint64_t wake_time
+			= list_entry(rq->sleepers.next, struct thread, run_list)->wake_time;
+		uint64_t until = wake_time > now ? wake_time - now : 0;
+		until = until < TIMER_MIN ? TIMER_MIN : until;
+		timeout = until < timeout ? until : timeout;
+	}
+	spin_unlock(&rq->lock);
+
+	if (timeout == UINT64_MAX) {
+		apic_stop_timer();
+	} else {
+		timeout = timeout > TIMER_MAX ? TIMER_MAX : timeout;
+		apic_set_timer(timeout, sched_tick, APIC_TIMER_ONE_SHOT);
+	}
+}
+
+/* Must be called with irqs disabled */
+static void *kstack_alloc(void) {
+	struct kstack_cache *cache = &kstack_caches[this_cpu_read(id)];
+	if (cache->count) {
+		return cache->stacks[--cache->count];
+	}
+
+	spin_lock(&kstack_lock);
+	void *stack = kstack_pool;
+	if (stack) {
+		kstack_pool = *(void **)stack;
+	}
+	spin_unlock(&kstack_lock);
+	if (stack) {
+		return stack;
+	}
+
+	return kmap(alloc_pages(KSTACK_SIZE), nullptr, KSTACK_SIZE,
+		PAGE_PRESENT | PAGE_WRITE);
+}
+
+/* Must be called with irqs disabled */
+static void kstack_free(void *stack) {
+	struct kstack_cache *cache = &kstack_caches[this_cpu_read(id)];
+	if (cache->count < KSTACK_CACHE) {
+		cache->stacks[cache->count++] = stack;
+		return;
+	}
+
+	spin_lock(&kstack_lock);
+	*(void **)stack = kstack_pool;
+	kstack_pool = stack;
+	spin_unlock(&kstack_lock);
+}
+
+/* Runs on the stack of the next thread, so prev is not touched anymore and may
+ * be picked by another processor. The stack of an exited prev can be reused
+ * now, the thread itself is left to reap_threads(). */
+static void finish_switch(struct thread *prev) {
+	if (__atomic_load_n(&prev->state, __ATOMIC_RELAXED) != THREAD_DEAD) {
+		__atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+		return;
+	}
+
+	kstack_free(prev->kernel_stack);
+	prev->dead_next = __atomic_load_n(&dead_threads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&dead_threads, &prev->dead_next, prev,
+		true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free the threads that exited. Their stacks were already recycled by
+ * finish_switch(). */
+static void reap_threads(void) {
+	if (!__atomic_load_n(&dead_threads, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	/* Take the whole list at once, threads that exit in the meantime are left
+	 * for the next call */
+	struct thread *dead
+		= __atomic_exchange_n(&dead_threads, nullptr, __ATOMIC_ACQUIRE);
+
+	spin_lock_irqsave(&proc_lock);
+	for (struct thread *t = dead; t; t = t->dead_next) {
+		list_del(&t->siblings);
+	}
+	spin_unlock_irqrestore(&proc_lock);
+
+	while (dead) {
+		struct thread *next = dead->dead_next;
+		free(dead);
+		dead = next;
+	}
+}
+
+/* Switch to the next runnable thread. Must be called with irqs disabled. */
+static void schedule(void) {
+	struct cpu *cpu = this_cpu();
+	struct runqueue *rq = &runqueues[cpu->id];
+	struct thread *prev = cpu->current_thread;
+	uint64_t now = tsc_ns();
+
+	if (cpu->preempt_count) {
+		panic("schedule(): called with preemption disabled");
+	}
+	/* Ends every RCU read-side critical section on this processor */
+	cpu->need_resched = false;
+	__atomic_store_n(&cpu->rcu_qs, cpu->rcu_qs + 1, __ATOMIC_RELEASE);
+
+	spin_lock(&rq->lock);
+	rq_wake_sleepers(rq, now);
+	if (!is_idle(prev)) {
+		uint64_t delta = now - prev->run_start;
+		if (prev->policy == SCHED_DEADLINE) {
+			prev->budget -= delta;
+		} else if (prev->policy == SCHED_FAIR) {
+			prev->vruntime += delta * SCHED_WEIGHT_DEFAULT / prev->weight;
+		} else {
+			prev->runtime += delta;
+		}
+
+		/* A blocked prev is only queued again by thread_wake(), a prev that
+		 * was woken before it switched away already is */
+		if (prev->state == THREAD_RUNNING && prev->policy == SCHED_DEADLINE
+			&& prev->budget <= 0) {
+			dl_throttle(rq, prev, now);
+		} else if (prev->state == THREAD_RUNNING) {
+			/* It used up its slice, so it is CPU bound */
+			if (prev->policy == SCHED_MLFQ
+				&& prev->runtime >= level_slice(prev->level)) {
+				if (prev->level < MLFQ_LEVELS - 1 && !prev->keep_level) {
+					++prev->level;
+				}
+				prev->runtime = 0;
+			}
+			__atomic_store_n(&prev->state, THREAD_READY, __ATOMIC_RELAXED);
+			rq_add(rq, prev);
+		}
+	}
+	if (now >= rq->next_boost) {
+		rq_boost(rq);
+		rq->next_boost = now + MLFQ_BOOST;
+	}
+	spin_unlock(&rq->lock);
+
+	struct thread *next = rq_dequeue(rq);
+	if (!next) {
+		next = steal_thread(cpu->id);
+		if (next && next->policy == SCHED_FAIR) {
+			next->vruntime += rq->min_vruntime;
+		}
+	}
+	if (!next) {
+		next = &idle_threads[cpu->id];
+	}
+
+	__atomic_store_n(&next->state, THREAD_RUNNING, __ATOMIC_RELAXED);
+	__atomic_store_n(&next->cpu, cpu->id, __ATOMIC_RELAXED);
+	next->run_start = now;
+
+	rq_set_timer(rq, next, now);
+
+	/* Let an idle processor steal the threads that still wait here */
+	uint64_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_RELAXED)
+	              & ~(1ULL << cpu->id);
+	if (idle && __atomic_load_n(&rq->nr_queued, __ATOMIC_RELAXED)) {
+		rq_kick(__builtin_ctzll(idle));
+	}
+
+	if (next == prev) {
+		return;
+	}
+	if (is_idle(prev)) {
+		__atomic_and_fetch(&idle_cpus, ~(1ULL << cpu->id), __ATOMIC_SEQ_CST);
+	}
+
+	next->on_cpu = true;
+	this_cpu_write(current_thread, next);
+	set_pml4(next->proc->pml4);
+
+	/* The irq disable count belongs to this thread, which may continue on
+	 * another processor */
+	uint64_t irq_disable_count = this_cpu_read(irq_disable_count);
+	prev = context_switch(prev, &prev->sp, next->sp);
+	finish_switch(prev);
+	this_cpu_write(irq_disable_count, irq_disable_count);
+}
+
+/* Switch threads once the irq handler returned, in irq_exit(), or if the
+ * running thread disabled preemption, in preempt_enable() */
+static void preempt(void) {
+	this_cpu_write(need_resched, true);
+}
+
+static void sched_tick([[maybe_unused]] struct interrupt_frame *frame) {
+	preempt();
+}
+
+static void resched_handler([[maybe_unused]] struct interrupt_frame *frame) {
+	apic_eoi();
+	/* The processor may not have reached sched_start() yet */
+	if (this_cpu_read(current_thread)) {
+		preempt();
+	}
+}
+
+/* The loop of a processor's idle thread */
+[[noreturn]] static void idle_loop(void) {
+	for (;;) {
+		irq_disable();
+		/* Returns once there is nothing else to run */
+		schedule();
+		reap_threads();
+		drain_deferred_blocks();
+		drain_deferred_pages();
+
+		struct cpu *cpu = this_cpu();
+		struct runqueue *rq = &runqueues[cpu->id];
+		__atomic_or_fetch(&idle_cpus, 1ULL << cpu->id, __ATOMIC_SEQ_CST);
+		if (use_mwait) {
+			monitor(&rq->kick);
+		}
+		if (__atomic_exchange_n(&rq->kick, 0, __ATOMIC_SEQ_CST)
+			|| __atomic_load_n(&rq->nr_queued, __ATOMIC_RELAXED)) {
+			irq_enable();
+		} else {
+			irq_enable_wait(use_mwait);
+		}
+		__atomic_and_fetch(&idle_cpus, ~(1ULL << cpu->id), __ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * @brief Called by thread_start() in switch.S when a new thread runs for the
+ * first time.
+ * @param prev The thread that ran before.
+ */
+void thread_start_finish(struct thread *prev) {
+	finish_switch(prev);
+	this_cpu_write(irq_disable_count, 1);
+	irq_enable();
 }
 
 /**
  * @brief Initialize the process tree.
  */
 void proc_init(void) {
-	kproc = malloc(sizeof(struct proc));
+	kproc = arena_alloc(sizeof(struct proc));
 
 	kproc->id = 0;
 	kproc->parent = nullptr;
 	init_list_head(&kproc->threads);
 	kproc->pml4 = pg_pml4;
 
-	list_add(&kproc->proc_list, &proc_list);
+	list_add_rcu(&kproc->proc_list, &proc_list);
+	if (!radix_insert(&proc_ids, kproc->id, kproc)) {
+		panic("Failed to index the kernel process!");
+	}
+
+	for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+		struct runqueue *rq = &runqueues[cpu];
+		for (uint8_t level = 0; level < MLFQ_LEVELS; ++level) {
+			init_list_head(&rq->levels[level]);
+		}
+		rq->dl_tree = (struct rb_root)RB_ROOT_INIT;
+		rq->fair_tree = (struct rb_root)RB_ROOT_INIT;
+		init_list_head(&rq->sleepers);
+		rq->current_rank = RANK_IDLE;
+	}
 
-	current_proc = kproc;
+	uint32_t eax, ebx, ecx, edx;
+	__cpuid(1, eax, ebx, ecx, edx);
+	use_mwait = ecx & (1 << 3); /* MONITOR/MWAIT */
+
+	int vector = idt_alloc_vector();
+	if (vector < 0) {
+		panic("No free vector for the reschedule IPI.");
+	}
+	resched_vector = vector;
+	idt_register(resched_vector, resched_handler);
 }
 
 /**
- * @brief Start the scheduler and execute created threads. The startup thread
- * will cease to exist shortly after.
+ * @brief Start the scheduler on the current processor and execute created
+ * threads. The calling context becomes the processor's idle thread, which only
+ * runs when no other thread is runnable and waits with hlt or mwait.
  */
-void sched_start(void) {
-	apic_set_timer(THREAD_TIME, switch_context, APIC_TIMER_ONE_SHOT);
+[[noreturn]] void sched_start(void) {
+	irq_disable();
+	struct cpu *cpu = this_cpu();
+	struct thread *idle = &idle_threads[cpu->id];
+
+	idle->id = 0;
+	idle->proc = kproc;
+	idle->on_cpu = true;
+	idle->pinned = true;
+	idle->state = THREAD_RUNNING;
+	idle->cpu = cpu->id;
+	cpu->current_thread = idle;
+	irq_enable();
+
+	idle_loop();
 }
 
 /**
- * @brief Create a new thread.
- * @param p The Process for which to create the thread.
- * @param func The function to be executed by the thread. Must not return.
- * @param data This pointer is passed to the executed function.
+ * @brief Move the current thread to the fair share class. Fair threads share
+ * the processor in proportion to their weights, but only run while no
+ * SCHED_MLFQ thread is runnable.
+ * @param weight The share relative to other fair threads, SCHED_WEIGHT_DEFAULT
+ * for an average thread.
  */
-void thread_new(struct proc *p, void *func, void *data) {
+void sched_set_fair(uint32_t weight) {
+	if (!weight) {
+		panic("sched_set_fair(): the weight must not be 0");
+	}
+
+	irq_disable();
+	struct cpu *cpu = this_cpu();
+	struct runqueue *rq = &runqueues[cpu->id];
+	struct thread *t = cpu->current_thread;
+
+	spin_lock(&rq->lock);
+	if (t->policy == SCHED_DEADLINE) {
+		rq->dl_bw -= t->dl_bw;
+	}
+	if (t->policy != SCHED_FAIR) {
+		t->vruntime = rq->min_vruntime;
+	}
+	t->policy = SCHED_FAIR;
+	t->weight = weight;
+	spin_unlock(&rq->lock);
+
+	/* Let MLFQ threads that are now ranked higher run */
+	schedule();
+	irq_enable();
+}
+
+/**
+ * @brief Move the current thread to the highest MLFQ level and keep it there,
+ * even if it uses up its slices. Meant for threads that handle latency
+ * critical events and block again quickly, such as irq threads.
+ */
+void sched_set_highest(void) {
+	irq_disable();
+	struct cpu *cpu = this_cpu();
+	struct runqueue *rq = &runqueues[cpu->id];
+	struct thread *t = cpu->current_thread;
+
+	spin_lock(&rq->lock);
+	if (t->policy == SCHED_DEADLINE) {
+		rq->dl_bw -= t->dl_bw;
+	}
+	t->policy = SCHED_MLFQ;
+	t->level = 0;
+	t->runtime = 0;
+	t->keep_level = true;
+	spin_unlock(&rq->lock);
+
+	schedule();
+	irq_enable();
+}
+
+/**
+ * @brief Move the current thread to the deadline class and pin it to the
+ * current processor. In every period it gets runtime ns of the processor before
+ * deadline ns have passed, ahead of all other classes. A thread that overruns
+ * its budget is throttled until its next period and counted as a deadline miss.
+ * @param runtime The budget per period in ns.
+ * @param deadline The deadline relative to the start of a period in ns, at
+ * least runtime.
+ * @param period The period in ns, at least deadline.
+ * @return Whether the thread was admitted, which fails if the bandwidth of all
+ * deadline threads on the processor would exceed 95%. The thread keeps its old
+ * class otherwise.
+ */
+bool sched_set_deadline(uint64_t runtime, uint64_t deadline, uint64_t period) {
+	if (!runtime || runtime > deadline || deadline > period) {
+		return false;
+	}
+	uint64_t bw = (runtime << DL_BW_SHIFT) / period;
+
+	irq_disable();
+	struct cpu *cpu = this_cpu();
+	struct runqueue *rq = &runqueues[cpu->id];
+	struct thread *t = cpu->current_thread;
+
+	spin_lock(&rq->lock);
+	uint64_t old_bw = t->policy == SCHED_DEADLINE ? t->dl_bw : 0;
+	if (rq->dl_bw - old_bw + bw > DL_BW_MAX) {
+		spin_unlock_irqrestore(&rq->lock);
+		return false;
+	}
+	rq->dl_bw += bw - old_bw;
+
+	t->policy = SCHED_DEADLINE;
+	t->pinned = true;
+	t->dl_runtime = runtime;
+	t->dl_deadline = deadline;
+	t->dl_period = period;
+	t->dl_bw = bw;
+	/* The first job starts now, earlier runtime is not charged to it */
+	uint64_t now = tsc_ns();
+	t->run_start = now;
+	t->abs_deadline = now + deadline;
+	t->budget = runtime;
+	spin_unlock(&rq->lock);
+
+	/* Timer for the budget */
+	schedule();
+	irq_enable();
+	return true;
+}
+
+/**
+ * @brief End the current job of a deadline thread and sleep until its next
+ * period starts with a full budget. A job that ends after its deadline is
+ * counted as a miss.
+ */
+void sched_wait_period(void) {
+	irq_disable();
+	struct cpu *cpu = this_cpu();
+	struct runqueue *rq = &runqueues[cpu->id];
+	struct thread *t = cpu->current_thread;
+	if (t->policy != SCHED_DEADLINE) {
+		panic("sched_wait_period(): not a deadline thread");
+	}
+
+	uint64_t now = tsc_ns();
+	if (now > t->abs_deadline) {
+		++t->dl_misses;
+		__atomic_add_fetch(&dl_misses, 1, __ATOMIC_RELAXED);
+	}
+	t->wake_time = t->abs_deadline - t->dl_deadline + t->dl_period;
+
+	spin_lock(&rq->lock);
+	rq_add_sleeper(rq, t);
+	spin_unlock(&rq->lock);
+
+	schedule();
+	irq_enable();
+}
+
+/**
+ * @brief Get the number of jobs of all deadline threads that ended after their
+ * deadline or were throttled.
+ * @return The number of deadline misses since boot.
+ */
+uint64_t sched_deadline_misses(void) {
+	return __atomic_load_n(&dl_misses, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Make a processor schedule soon, e.g. so that it passes a quiescent
+ * state.
+ * @param cpu The index of the processor.
+ */
+void sched_kick(uint32_t cpu) {
 	irq_disable();
+	rq_kick(cpu);
+	irq_enable();
+}
+
+/**
+ * @brief Switch threads if an irq wanted to. Called by irq_exit() and by
+ * preempt_enable() in case preemption was disabled. Does nothing inside
+ * interrupt handlers and softirqs, irq_exit() switches after them.
+ */
+void sched_preempt(void) {
+	irq_disable();
+	if (!this_cpu_read(preempt_count) && !in_interrupt()
+		&& this_cpu_read(need_resched)) {
+		schedule();
+	}
+	irq_enable();
+}
 
+/**
+ * @brief Get the priority that a thread lends to the owner of a pi_mutex it
+ * waits for: its own MLFQ level or the one it inherited itself. Deadline
+ * threads lend the highest level, fair threads only what they inherited.
+ * @param t The waiting thread.
+ * @return The MLFQ level, UINT8_MAX if it has none to lend.
+ */
+uint8_t sched_pi_level(const struct thread *t) {
+	if (t->policy == SCHED_DEADLINE) {
+		return 0;
+	}
+	uint8_t level = t->policy == SCHED_MLFQ ? t->level : UINT8_MAX;
+	uint8_t pi_level = __atomic_load_n(&t->pi_level, __ATOMIC_RELAXED);
+	return pi_level < level ? pi_level : level;
+}
+
+/**
+ * @brief Let a thread run on an MLFQ level it inherited, while it holds a
+ * pi_mutex that a higher ranked thread waits for. Threads on a lower level and
+ * fair threads are requeued on it, deadline threads are not affected.
+ * @param t The thread, in any state.
+ * @param level The inherited level, UINT8_MAX to drop it again.
+ */
+void sched_set_pi_level(struct thread *t, uint8_t level) {
+	irq_disable();
+	/* A queued thread is in the runqueue of its processor, which only changes
+	 * while it is not queued */
+	uint32_t cpu;
+	struct runqueue *rq;
+	for (;;) {
+		cpu = __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+		rq = &runqueues[cpu];
+		spin_lock(&rq->lock);
+		if (__atomic_load_n(&t->cpu, __ATOMIC_RELAXED) == cpu) {
+			break;
+		}
+		spin_unlock(&rq->lock);
+	}
+
+	uint8_t old_rank = rank(t);
+	bool queued = t->queued;
+	if (queued) {
+		rq_del(rq, t);
+	}
+	__atomic_store_n(&t->pi_level, level, __ATOMIC_RELAXED);
+
+	/* A boosted thread may now preempt the running one, a running thread
+	 * that lost its boost may have to give way to queued ones */
+	bool kick = false;
+	if (queued) {
+		rq_add(rq, t);
+		kick = rank(t) < rq->current_rank;
+	} else if (__atomic_load_n(&cpus[cpu].current_thread, __ATOMIC_RELAXED)
+		== t) {
+		rq->current_rank = rank(t);
+		kick = rank(t) > old_rank && rq->nr_queued;
+	}
+	spin_unlock(&rq->lock);
+
+	if (kick) {
+		rq_kick(cpu);
+	}
+	irq_enable();
+}
+
+/**
+ * @brief Give up the processor to the next runnable thread, if there is one.
+ */
+void sched_yield(void) {
+	irq_disable();
+	if (this_cpu_read(current_thread)) {
+		schedule();
+	}
+	irq_enable();
+}
+
+/**
+ * @brief Get the thread running on the current processor.
+ * @return The thread or nullptr before sched_start().
+ */
+struct thread *thread_current(void) {
+	/* Whichever processor the load runs on, it runs this thread */
+	return this_cpu_read(current_thread);
+}
+
+/**
+ * @brief Switch away from the current thread until it is woken by
+ * thread_wake(). The caller must have set its state to THREAD_BLOCKED after
+ * making it visible to a waker and must have disabled irqs in between, so that
+ * no wakeup can be lost.
+ */
+void thread_block(void) {
+	schedule();
+}
+
+/**
+ * @brief Make a blocked thread runnable again.
+ * @param t The thread to wake.
+ * @return Whether the thread was blocked.
+ */
+bool thread_wake(struct thread *t) {
+	enum thread_state expected = THREAD_BLOCKED;
+	if (!__atomic_compare_exchange_n(&t->state, &expected, THREAD_READY, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return false;
+	}
+
+	/* The thread may still be switching away on its processor, which is the
+	 * only one that takes it from the queue before on_cpu is cleared */
+	irq_disable();
+	uint32_t cpu = __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+	if (rq_enqueue(&runqueues[cpu], t, true)) {
+		rq_kick(cpu);
+	}
+	irq_enable();
+	return true;
+}
+
+/**
+ * @brief Let the current thread sleep. It becomes runnable again when its
+ * processor schedules after the time has passed.
+ * @param ns The minimum time to sleep in nanoseconds.
+ */
+void thread_sleep(uint64_t ns) {
+	uint64_t wake_time = tsc_ns() + ns;
+
+	irq_disable();
+	struct cpu *cpu = this_cpu();
+	struct thread *t = cpu->current_thread;
+	if (!t || is_idle(t)) {
+		/* Nothing to switch to */
+		irq_enable();
+		while (tsc_ns() < wake_time) {
+			pause();
+		}
+		return;
+	}
+
+	struct runqueue *rq = &runqueues[cpu->id];
+	t->wake_time = wake_time;
+	spin_lock(&rq->lock);
+	rq_add_sleeper(rq, t);
+	spin_unlock(&rq->lock);
+
+	schedule();
+	irq_enable();
+}
+
+/**
+ * @brief End the current thread. Its stack is recycled as soon as another
+ * thread runs on the processor, the thread itself is freed later.
+ */
+[[noreturn]] void thread_exit(void) {
+	irq_disable();
+	struct cpu *cpu = this_cpu();
+	struct runqueue *rq = &runqueues[cpu->id];
+	struct thread *t = cpu->current_thread;
+	if (is_idle(t)) {
+		panic("thread_exit(): the idle thread cannot exit");
+	}
+
+	spin_lock(&rq->lock);
+	if (t->policy == SCHED_DEADLINE) {
+		rq->dl_bw -= t->dl_bw;
+	}
+	spin_unlock(&rq->lock);
+
+	__atomic_store_n(&t->state, THREAD_DEAD, __ATOMIC_RELAXED);
+	schedule();
+	panic("thread_exit(): an exited thread was scheduled");
+}
+
+/**
+ * @brief Get the id of the thread running on the current processor.
+ * @return The id, 0 for the idle thread.
+ */
+uint64_t get_current_thread_id(void) {
+	return this_cpu_read(current_thread)->id;
+}
+
+/* Must be called with irqs disabled */
+static struct thread *thread_create(struct proc *p, void *func, void *data) {
+	reap_threads();
 	struct thread *t = malloc(sizeof(struct thread));
 
-	t->id = ++last_thread_id;
+	t->id = __atomic_add_fetch(&last_thread_id, 1, __ATOMIC_RELAXED);
 	t->proc = p;
+	t->on_cpu = false;
+	t->pinned = false;
+	t->state = THREAD_READY;
+	t->policy = SCHED_MLFQ;
+	t->level = 0;
+	t->runtime = 0;
+	t->weight = SCHED_WEIGHT_DEFAULT;
+	t->dl_misses = 0;
+	t->queued = false;
+	t->keep_level = false;
+	t->pi_level = UINT8_MAX;
+	t->pi_blocked_on = nullptr;
+	init_list_head(&t->wait_list);
+	init_list_head(&t->pi_held);
 
-	t->kernel_stack = kmap(alloc_pages(KSTACK_SIZE), nullptr, KSTACK_SIZE,
-		PAGE_PRESENT | PAGE_WRITE);
-	uint64_t stack_top = (uint64_t)t->kernel_stack + KSTACK_SIZE - 16;
+	t->kernel_stack = kstack_alloc();
 
-	t->regs = malloc(sizeof(struct interrupt_frame));
-	*(t->regs) = (struct interrupt_frame) {.cs = GDT_KERNEL_CS | GDT_RPL_0,
-		.ss = GDT_KERNEL_DS | GDT_RPL_0,
-		.rsp = (uint64_t)stack_top,
-		.rbp = (uint64_t)stack_top,
-		.rflags = RFLAGS_IF,
-		.rip = (uint64_t)func,
-		.rdi = (uint64_t)data};
+	/* The initial context restored by context_switch(), see switch.S. The
+	 * stack is 16 byte aligned again once thread_start is entered. */
+	uint64_t *sp = (uint64_t *)((uint64_t)t->kernel_stack + KSTACK_SIZE);
+	*--sp = (uint64_t)thread_start;
+	*--sp = 0; /* rbx */
+	*--sp = 0; /* rbp, terminates the chain of frame pointers */
+	*--sp = (uint64_t)func; /* r12 */
+	*--sp = (uint64_t)data; /* r13 */
+	*--sp = 0; /* r14 */
+	*--sp = 0; /* r15 */
+	t->sp = sp;
 
-	init_list_head(&p->threads);
+	spin_lock(&proc_lock);
 	list_add(&t->siblings, &p->threads);
+	spin_unlock(&proc_lock);
 
-	list_add(&t->thread_list, &thread_list);
+	return t;
+}
 
+/**
+ * @brief Create a new thread on the least loaded processor.
+ * @param p The Process for which to create the thread.
+ * @param func The function to be executed by the thread. Must not return.
+ * @param data This pointer is passed to the executed function.
+ */
+void thread_new(struct proc *p, void *func, void *data) {
+	irq_disable();
+	struct thread *t = thread_create(p, func, data);
+	t->cpu = least_loaded_cpu();
+	if (rq_enqueue(&runqueues[t->cpu], t, false)) {
+		rq_kick(t->cpu);
+	}
 	irq_enable();
 }
 
@@ -114,17 +1233,36 @@ void proc_new(void *func, void *data) {
 
 	struct proc *p = malloc(sizeof(struct proc));
 
-	p->id = ++last_thread_id;
-	p->parent = current_proc;
+	p->id = __atomic_add_fetch(&last_thread_id, 1, __ATOMIC_RELAXED);
+	struct thread *current = this_cpu_read(current_thread);
+	p->parent = current ? current->proc : kproc;
 	p->pml4 = alloc_pml4();
+	init_list_head(&p->threads);
 
-	thread_new(p, func, data);
+	spin_lock(&proc_lock);
+	list_add_rcu(&p->proc_list, &proc_list);
+	if (!radix_insert(&proc_ids, p->id, p)) {
+		panic("proc_new(): failed to index process %w64u", p->id);
+	}
+	spin_unlock(&proc_lock);
 
-	list_add(&p->proc_list, &proc_list);
+	thread_new(p, func, data);
 
 	irq_enable();
 }
 
+/**
+ * @brief Look up a process without taking a lock.
+ * @param id The id of the process.
+ * @return The process or nullptr if there is none with the id.
+ */
+struct proc *proc_find(uint64_t id) {
+	rcu_read_lock();
+	struct proc *p = radix_lookup(&proc_ids, id);
+	rcu_read_unlock();
+	return p;
+}
+
 struct kthread_wrapper_data {
 	void *func;
 	void *data;
@@ -135,7 +1273,15 @@ struct kthread_wrapper_data {
 	void *data = d->data;
 	free(d);
 	((void (*)(void *))func)(data);
-	for (;;);
+	thread_exit();
+}
+
+static struct kthread_wrapper_data *kthread_wrap(void *func, void *data) {
+	struct kthread_wrapper_data *d
+		= malloc(sizeof(struct kthread_wrapper_data));
+	d->func = func;
+	d->data = data;
+	return d;
 }
 
 /**
@@ -144,9 +1290,23 @@ struct kthread_wrapper_data {
  * @param data This pointer is passed to the executed function.
  */
 void kthread_new(void *func, void *data) {
-	struct kthread_wrapper_data *d
-		= malloc(sizeof(struct kthread_wrapper_data));
-	d->func = func;
-	d->data = data;
-	thread_new(kproc, kthread_wrapper, d);
+	thread_new(kproc, kthread_wrapper, kthread_wrap(func, data));
+}
+
+/**
+ * @brief Create a new kthread that only ever runs on one processor.
+ * @param cpu The index of the processor.
+ * @param func The function to be executed by the thread. Can return.
+ * @param data This pointer is passed to the executed function.
+ */
+void kthread_new_on(uint32_t cpu, void *func, void *data) {
+	irq_disable();
+	struct thread *t
+		= thread_create(kproc, kthread_wrapper, kthread_wrap(func, data));
+	t->pinned = true;
+	t->cpu = cpu;
+	if (rq_enqueue(&runqueues[cpu], t, false)) {
+		rq_kick(cpu);
+	}
+	irq_enable();
 }
@@ -1,20 +1,73 @@
 #pragma once
 
 #include "cpu/idt.h"
+#include "cpu/smp.h"
 #include "util/list.h"
+#include "util/rbtree.h"
 
 #include <stddef.h>
 #include <stdint.h>
 
+struct pi_mutex;
 struct proc;
 
+/**
+ * @enum thread_state
+ * @brief A thread is in a runqueue exactly while it is THREAD_READY.
+ */
+enum thread_state {
+	THREAD_RUNNING,
+	THREAD_READY,
+	THREAD_BLOCKED, /* Until thread_wake() */
+	THREAD_SLEEPING, /* Until its wake_time */
+	THREAD_DEAD /* After thread_exit(), until it is reaped */
+};
+
+/**
+ * @enum sched_policy
+ * @brief The scheduling class of a thread.
+ */
+enum sched_policy {
+	SCHED_MLFQ, /* Priority levels with feedback, the default */
+	SCHED_FAIR, /* Proportional share by weight, below all MLFQ levels */
+	SCHED_DEADLINE /* Earliest deadline first with a budget, above MLFQ */
+};
+
+#define SCHED_WEIGHT_DEFAULT (1'024)
+
 struct thread {
-	struct list_head thread_list;
+	struct list_head run_list; /* Entry in a runqueue or the sleepers list */
+	struct list_head wait_list; /* Entry in a wait_queue */
 	uint64_t id;
 	void *kernel_stack;
 	struct proc *proc;
-	struct interrupt_frame *regs;
+	void *sp; /* Saved kernel stack pointer while not running */
 	struct list_head siblings;
+	struct thread *dead_next; /* Entry in the list of exited threads */
+	bool on_cpu; /* Running, or its stack is still used by a processor */
+	bool pinned; /* Never stolen by another processor */
+	bool queued; /* In the runqueue of its processor */
+	enum thread_state state;
+	uint32_t cpu; /* The processor it runs or last ran on */
+	uint64_t wake_time; /* In ns, while THREAD_SLEEPING */
+	uint64_t run_start; /* When it was last switched to */
+	enum sched_policy policy;
+	uint8_t level; /* SCHED_MLFQ priority level, 0 is the highest */
+	bool keep_level; /* SCHED_MLFQ, never demoted */
+	uint64_t runtime; /* SCHED_MLFQ time used on the current level in ns */
+	uint32_t weight; /* SCHED_FAIR */
+	uint64_t vruntime; /* SCHED_FAIR, ns scaled by the weight */
+	struct rb_node tree_node; /* SCHED_FAIR or SCHED_DEADLINE runqueue entry */
+	uint64_t dl_runtime; /* SCHED_DEADLINE budget per period in ns */
+	uint64_t dl_deadline; /* SCHED_DEADLINE relative to the period in ns */
+	uint64_t dl_period; /* SCHED_DEADLINE in ns */
+	uint64_t dl_bw; /* SCHED_DEADLINE runtime / period in fixed point */
+	uint64_t abs_deadline; /* SCHED_DEADLINE deadline of the current job */
+	int64_t budget; /* SCHED_DEADLINE runtime left of the current job */
+	uint64_t dl_misses; /* SCHED_DEADLINE jobs that missed their deadline */
+	uint8_t pi_level; /* Inherited MLFQ level, UINT8_MAX if none */
+	struct pi_mutex *pi_blocked_on; /* The pi_mutex it waits for */
+	struct list_head pi_held; /* Owned pi_mutexes that have waiters */
 };
 
 struct proc {
@@ -26,13 +79,50 @@ struct proc {
 };
 
 void kthread_new(void *func, void *data);
+void kthread_new_on(uint32_t cpu, void *func, void *data);
 uint64_t get_current_thread_id(void);
 
 void proc_init(void);
-void sched_start(void);
+[[noreturn]] void sched_start(void);
+void sched_yield(void);
+void sched_set_fair(uint32_t weight);
+void sched_set_highest(void);
+bool sched_set_deadline(uint64_t runtime, uint64_t deadline, uint64_t period);
+void sched_wait_period(void);
+uint64_t sched_deadline_misses(void);
+
+struct thread *thread_current(void);
+void thread_block(void);
+bool thread_wake(struct thread *t);
+void thread_sleep(uint64_t ns);
+[[noreturn]] void thread_exit(void);
 void sched_pause(void);
 void sched_resume(void);
+void sched_kick(uint32_t cpu);
+void sched_preempt(void);
+uint8_t sched_pi_level(const struct thread *t);
+void sched_set_pi_level(struct thread *t, uint8_t level);
+
+/**
+ * @brief Keep the current thread running on this processor. Timer and
+ * reschedule irqs only note that a switch is due until the matching
+ * preempt_enable(). Nests. The thread must not block or yield in between.
+ */
+static inline void preempt_disable(void) {
+	this_cpu_add(preempt_count, 1);
+}
+
+/**
+ * @brief Allow preemption again and switch threads if a switch was deferred.
+ */
+static inline void preempt_enable(void) {
+	this_cpu_add(preempt_count, -1);
+	if (this_cpu_read(need_resched)) {
+		sched_preempt();
+	}
+}
 
 void proc_new(void *func, void *data);
+struct proc *proc_find(uint64_t id);
 
 void thread_new(struct proc *p, void *func, void *data);
@@ -0,0 +1,88 @@
+#include "rcu.h"
+
+#include "proc.h"
+#include "wait.h"
+
+#include "cpu/smp.h"
+
+#include <stdint.h>
+
+/* Time between checks whether all processors passed a quiescent state */
+#define RCU_POLL (100'000)
+
+/* Callbacks queued by call_rcu(), linked through their next pointer */
+static struct rcu_head *rcu_pending;
+static struct wait_queue rcu_wq = WAIT_QUEUE_INIT(rcu_wq);
+
+/* Runs the callbacks of call_rcu() in batches, one grace period per batch */
+static void rcu_thread(void *) {
+	for (;;) {
+		wait_event(&rcu_wq, __atomic_load_n(&rcu_pending, __ATOMIC_RELAXED));
+
+		/* Callbacks queued in the meantime wait for the next grace period */
+		struct rcu_head *head
+			= __atomic_exchange_n(&rcu_pending, nullptr, __ATOMIC_ACQUIRE);
+		synchronize_rcu();
+		while (head) {
+			struct rcu_head *next = head->next;
+			head->func(head);
+			head = next;
+		}
+	}
+}
+
+/**
+ * @brief Start the thread that runs the callbacks of call_rcu().
+ */
+void rcu_init(void) {
+	kthread_new(rcu_thread, nullptr);
+}
+
+/**
+ * @brief Wait until all read-side critical sections that were running on any
+ * processor have ended. A processor passes a quiescent state whenever it
+ * schedules, which it cannot do inside a read-side critical section.
+ * Processors that do not schedule on their own are kicked. Must be called from
+ * a thread outside of a read-side critical section.
+ */
+void synchronize_rcu(void) {
+	/* Before sched_start() nothing else runs */
+	if (!thread_current()) {
+		return;
+	}
+
+	uint64_t snapshot[SMP_MAX_CPUS];
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		snapshot[cpu] = __atomic_load_n(&cpus[cpu].rcu_qs, __ATOMIC_ACQUIRE);
+	}
+
+	/* The current processor schedules in thread_sleep() */
+	uint32_t self = this_cpu_read(id);
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		if (cpu != self) {
+			sched_kick(cpu);
+		}
+	}
+
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		while (__atomic_load_n(&cpus[cpu].rcu_qs, __ATOMIC_ACQUIRE)
+			== snapshot[cpu]) {
+			thread_sleep(RCU_POLL);
+		}
+	}
+}
+
+/**
+ * @brief Call a function after a grace period, usually to free an object that
+ * was unpublished. Can be called from any context, including irq handlers.
+ * Callbacks run in a thread and may block.
+ * @param head The rcu_head embedded in the object.
+ * @param func The function to call with head.
+ */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+	head->func = func;
+	head->next = __atomic_load_n(&rcu_pending, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rcu_pending, &head->next, head, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	wake_one(&rcu_wq);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "proc.h"
+
+/**
+ * @struct rcu_head
+ * @brief Embedded in an object that is freed with call_rcu().
+ */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+/**
+ * @def rcu_dereference(p)
+ * @brief Load a pointer published with rcu_assign_pointer(), inside a read-side
+ * critical section.
+ * @param p The pointer to load, an lvalue.
+ */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/**
+ * @def rcu_assign_pointer(p, v)
+ * @brief Publish a pointer to an initialized object to readers.
+ * @param p The pointer to store to, an lvalue.
+ * @param v The new value.
+ */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/**
+ * @brief Enter a read-side critical section. Objects loaded with
+ * rcu_dereference() stay valid until rcu_read_unlock(). Nests, but the thread
+ * must not block or yield inside. Sections with irqs disabled are read-side
+ * critical sections as well.
+ */
+static inline void rcu_read_lock(void) {
+	preempt_disable();
+}
+
+/**
+ * @brief Leave a read-side critical section.
+ */
+static inline void rcu_read_unlock(void) {
+	preempt_enable();
+}
+
+void rcu_init(void);
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
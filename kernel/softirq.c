@@ -0,0 +1,193 @@
+#include "softirq.h"
+
+#include "proc.h"
+#include "wait.h"
+
+#include "cpu/idt.h"
+#include "cpu/smp.h"
+#include "util/panic.h"
+
+#include <stdint.h>
+
+/* How often irq_exit() looks for softirqs raised while it ran them, before the
+ * rest is left to the softirq thread of the processor */
+#define SOFTIRQ_RESTARTS (10)
+
+#define TASKLET_SCHEDULED (1 << 0) /* Queued on a processor */
+#define TASKLET_RUNNING   (1 << 1) /* Its function runs */
+
+static softirq_handler softirq_handlers[SOFTIRQ_COUNT];
+
+/* Each processor's softirq thread runs the softirqs that are raised outside of
+ * interrupts or that irq_exit() left over */
+static struct wait_queue softirq_wqs[SMP_MAX_CPUS];
+
+/**
+ * @struct tasklet_list
+ * @brief The tasklets scheduled on a processor, in the order they were
+ * scheduled. Only accessed by its processor with irqs disabled.
+ */
+struct tasklet_list {
+	alignas(64) struct tasklet *head;
+	struct tasklet **tail;
+};
+
+static struct tasklet_list tasklet_lists[SMP_MAX_CPUS];
+
+/* Run the raised softirqs with irqs enabled, repeating while new ones are
+ * raised, at most max_restarts times. Must be called with irqs disabled
+ * exactly once. Returns whether softirqs are still pending. */
+static bool run_softirqs(unsigned max_restarts) {
+	this_cpu_write(in_softirq, true);
+	for (unsigned i = 0; i <= max_restarts; ++i) {
+		uint32_t pending = this_cpu_read(softirq_pending);
+		if (!pending) {
+			break;
+		}
+		this_cpu_write(softirq_pending, 0);
+
+		/* The thread cannot move to another processor, because nothing
+		 * schedules while in_softirq is set */
+		irq_enable();
+		while (pending) {
+			unsigned nr = __builtin_ctz(pending);
+			pending &= pending - 1;
+			softirq_handlers[nr]();
+		}
+		irq_disable();
+	}
+	this_cpu_write(in_softirq, false);
+	return this_cpu_read(softirq_pending);
+}
+
+static void softirq_thread(void *) {
+	struct wait_queue *wq = &softirq_wqs[this_cpu_read(id)];
+	for (;;) {
+		wait_event(wq, this_cpu_read(softirq_pending));
+
+		irq_disable();
+		run_softirqs(SOFTIRQ_RESTARTS);
+		irq_enable();
+		/* Let other threads run in between, softirqs may be raised again
+		 * and again */
+		sched_yield();
+	}
+}
+
+/**
+ * @brief Called by interrupt_stub() after the handler returned, with irqs
+ * disabled. Runs the softirqs raised by the handler and switches threads if the
+ * handler asked for it, unless this interrupted another handler or softirqs.
+ */
+void irq_exit(void) {
+	/* Exceptions can also occur with irqs disabled */
+	if (this_cpu_read(in_softirq) || this_cpu_read(irq_depth)
+		|| this_cpu_read(irq_disable_count) != 1) {
+		return;
+	}
+
+	if (this_cpu_read(softirq_pending) && run_softirqs(SOFTIRQ_RESTARTS)) {
+		wake_one(&softirq_wqs[this_cpu_read(id)]);
+	}
+
+	/* The processor may not have reached sched_start() yet */
+	if (this_cpu_read(need_resched) && this_cpu_read(current_thread)) {
+		sched_preempt();
+	}
+}
+
+/**
+ * @brief Set the handler of a softirq.
+ * @param nr The softirq.
+ * @param handler The function to run whenever the softirq was raised.
+ */
+void softirq_register(enum softirq nr, softirq_handler handler) {
+	softirq_handlers[nr] = handler;
+}
+
+/**
+ * @brief Run a softirq on the current processor soon: when the interrupt
+ * handler that raised it returns, or in the softirq thread of the processor if
+ * it was not raised by an interrupt handler.
+ * @param nr The softirq.
+ */
+void raise_softirq(enum softirq nr) {
+	irq_disable();
+	this_cpu_write(softirq_pending, this_cpu_read(softirq_pending) | 1 << nr);
+	if (!in_interrupt()) {
+		wake_one(&softirq_wqs[this_cpu_read(id)]);
+	}
+	irq_enable();
+}
+
+static void tasklet_action(void) {
+	irq_disable();
+	struct tasklet_list *list = &tasklet_lists[this_cpu_read(id)];
+	struct tasklet *tasklet = list->head;
+	list->head = nullptr;
+	list->tail = &list->head;
+	irq_enable();
+
+	while (tasklet) {
+		struct tasklet *next = tasklet->next;
+
+		/* It still runs on another processor, which it may only do once at
+		 * a time, so try again later */
+		if (__atomic_fetch_or(&tasklet->state, TASKLET_RUNNING,
+				__ATOMIC_ACQUIRE) & TASKLET_RUNNING) {
+			irq_disable();
+			tasklet->next = nullptr;
+			*list->tail = tasklet;
+			list->tail = &tasklet->next;
+			raise_softirq(SOFTIRQ_TASKLET);
+			irq_enable();
+			tasklet = next;
+			continue;
+		}
+
+		/* Cleared first, so the function can schedule the tasklet again */
+		__atomic_and_fetch(&tasklet->state, ~TASKLET_SCHEDULED,
+			__ATOMIC_RELAXED);
+		tasklet->func(tasklet);
+		__atomic_and_fetch(&tasklet->state, ~TASKLET_RUNNING,
+			__ATOMIC_RELEASE);
+		tasklet = next;
+	}
+}
+
+/**
+ * @brief Run a tasklet in a softirq on the current processor. Does nothing if
+ * it is already scheduled and did not start running yet. Can be called from any
+ * context.
+ * @param tasklet The tasklet.
+ */
+void tasklet_schedule(struct tasklet *tasklet) {
+	if (__atomic_fetch_or(&tasklet->state, TASKLET_SCHEDULED,
+			__ATOMIC_ACQ_REL) & TASKLET_SCHEDULED) {
+		return;
+	}
+
+	irq_disable();
+	struct tasklet_list *list = &tasklet_lists[this_cpu_read(id)];
+	tasklet->next = nullptr;
+	*list->tail = tasklet;
+	list->tail = &tasklet->next;
+	raise_softirq(SOFTIRQ_TASKLET);
+	irq_enable();
+}
+
+/**
+ * @brief Start the softirq thread of every processor and set up tasklets.
+ */
+void softirq_init(void) {
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		tasklet_lists[cpu].head = nullptr;
+		tasklet_lists[cpu].tail = &tasklet_lists[cpu].head;
+		wait_queue_init(&softirq_wqs[cpu]);
+	}
+	softirq_register(SOFTIRQ_TASKLET, tasklet_action);
+
+	for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+		kthread_new_on(cpu, softirq_thread, nullptr);
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "cpu/smp.h"
+
+#include <stdint.h>
+
+/* Interrupt handlers are split in two halves. The top half runs in the handler
+ * registered with idt_register(), with irqs disabled, and only acknowledges the
+ * device and queues the rest of the work. The bottom half runs as a softirq on
+ * the same processor when the last interrupt handler returns, with irqs
+ * enabled. Softirqs must not block either. Work that has to block goes to a
+ * workqueue, see workqueue.h. */
+
+/**
+ * @enum softirq
+ * @brief The bottom halves, run in this order.
+ */
+enum softirq {
+	SOFTIRQ_TASKLET, /* Runs the tasklets scheduled on the processor */
+	SOFTIRQ_COUNT
+};
+
+typedef void (*softirq_handler)(void);
+
+void softirq_init(void);
+void softirq_register(enum softirq nr, softirq_handler handler);
+void raise_softirq(enum softirq nr);
+void irq_exit(void);
+
+/**
+ * @struct tasklet
+ * @brief Deferred work that runs in a softirq on the processor that scheduled
+ * it. A tasklet never runs on two processors at once and runs once, however
+ * often it was scheduled before that.
+ */
+struct tasklet {
+	struct tasklet *next;
+	void (*func)(struct tasklet *tasklet);
+	uint32_t state;
+};
+
+/**
+ * @def TASKLET_INIT(func)
+ * @brief Statically initialize a tasklet.
+ * @param func The function to run, it gets the tasklet as argument.
+ */
+#define TASKLET_INIT(func) {nullptr, (func), 0}
+
+void tasklet_schedule(struct tasklet *tasklet);
+
+/**
+ * @brief Check whether the current processor runs an interrupt handler or
+ * softirqs. Code running there must not block.
+ * @return Whether it is in interrupt context.
+ */
+static inline bool in_interrupt(void) {
+	return this_cpu_read(irq_depth) || this_cpu_read(in_softirq);
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include "lock_stats.h"
+
+#include "cpu/idt.h"
+#include "cpu/x86.h"
+
+#include <stdint.h>
+
+/* All locks spin with irqs in whatever state the caller left them. The caller
+ * is responsible for disabling irqs if a lock is also taken in interrupt
+ * handlers, e.g. with spin_lock_irqsave(). */
+
+/**
+ * @struct spinlock
+ * @brief A test-and-test-and-set lock. Cheapest when uncontended, but waiters
+ * are served in no particular order.
+ */
+struct spinlock {
+	bool locked;
+#ifdef LOCK_STATS
+	struct lock_stats stats;
+#endif
+};
+
+/**
+ * @def SPINLOCK_INIT
+ * @brief Statically initialize an unlocked spinlock.
+ */
+#define SPINLOCK_INIT {false LOCK_STATS_INIT}
+
+/**
+ * @brief Acquire a spinlock.
+ * @param lock The lock to acquire.
+ */
+static inline void spin_lock(struct spinlock *lock) {
+	uint64_t spins = 0;
+	while (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+		/* Wait for the lock to look free before retrying the atomic, so the
+		 * cache line is not bounced between waiting CPUs */
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+			pause();
+			++spins;
+		}
+	}
+	LOCK_STATS_ACQUIRED(lock, spins);
+}
+
+/**
+ * @brief Try to acquire a spinlock without waiting.
+ * @param lock The lock to acquire.
+ * @return Whether the lock was acquired.
+ */
+static inline bool spin_trylock(struct spinlock *lock) {
+	if (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)
+		|| __atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	LOCK_STATS_ACQUIRED(lock, 0);
+	return true;
+}
+
+/**
+ * @brief Release a spinlock.
+ * @param lock The lock to release.
+ */
+static inline void spin_unlock(struct spinlock *lock) {
+	LOCK_STATS_RELEASED(lock);
+	__atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Disable irqs and acquire a spinlock. irq_disable() nests, so the
+ * previous irq state is restored by spin_unlock_irqrestore().
+ * @param lock The lock to acquire.
+ */
+static inline void spin_lock_irqsave(struct spinlock *lock) {
+	irq_disable();
+	spin_lock(lock);
+}
+
+/**
+ * @brief Release a spinlock taken with spin_lock_irqsave() and restore the
+ * previous irq state.
+ * @param lock The lock to release.
+ */
+static inline void spin_unlock_irqrestore(struct spinlock *lock) {
+	spin_unlock(lock);
+	irq_enable();
+}
+
+/**
+ * @struct ticket_lock
+ * @brief A fair lock: waiters are served in the order they arrived. All of
+ * them spin on the same cache line, so it suits moderately contended locks.
+ */
+struct ticket_lock {
+	uint32_t next; /* The ticket of the next acquirer */
+	uint32_t owner; /* The ticket that holds the lock */
+#ifdef LOCK_STATS
+	struct lock_stats stats;
+#endif
+};
+
+/**
+ * @def TICKET_LOCK_INIT
+ * @brief Statically initialize an unlocked ticket lock.
+ */
+#define TICKET_LOCK_INIT {0, 0 LOCK_STATS_INIT}
+
+/**
+ * @brief Acquire a ticket lock.
+ * @param lock The lock to acquire.
+ */
+static inline void ticket_lock(struct ticket_lock *lock) {
+	uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	uint64_t spins = 0;
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+		pause();
+		++spins;
+	}
+	LOCK_STATS_ACQUIRED(lock, spins);
+}
+
+/**
+ * @brief Release a ticket lock.
+ * @param lock The lock to release.
+ */
+static inline void ticket_unlock(struct ticket_lock *lock) {
+	LOCK_STATS_RELEASED(lock);
+	/* Only the holder writes owner */
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @struct mcs_node
+ * @brief The place of a waiter in the queue of an mcs_lock. It usually lives on
+ * the stack of the acquirer and must stay valid until the lock is released.
+ */
+struct mcs_node {
+	struct mcs_node *next;
+	bool locked;
+};
+
+/**
+ * @struct mcs_lock
+ * @brief A fair queue lock: every waiter spins on its own mcs_node, so a
+ * release only touches the cache line of the next waiter. It suits highly
+ * contended locks.
+ */
+struct mcs_lock {
+	struct mcs_node *tail; /* The last waiter, nullptr if unlocked */
+#ifdef LOCK_STATS
+	struct lock_stats stats;
+#endif
+};
+
+/**
+ * @def MCS_LOCK_INIT
+ * @brief Statically initialize an unlocked MCS lock.
+ */
+#define MCS_LOCK_INIT {nullptr LOCK_STATS_INIT}
+
+/**
+ * @brief Acquire an MCS lock.
+ * @param lock The lock to acquire.
+ * @param node The node of the caller, passed to mcs_unlock() again.
+ */
+static inline void mcs_lock(struct mcs_lock *lock, struct mcs_node *node) {
+	node->next = nullptr;
+	node->locked = true;
+
+	uint64_t spins = 0;
+	struct mcs_node *prev
+		= __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (prev) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+			pause();
+			++spins;
+		}
+	}
+	LOCK_STATS_ACQUIRED(lock, spins);
+}
+
+/**
+ * @brief Release an MCS lock and hand it to the next waiter.
+ * @param lock The lock to release.
+ * @param node The node passed to mcs_lock().
+ */
+static inline void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node) {
+	LOCK_STATS_RELEASED(lock);
+
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (!next) {
+		struct mcs_node *expected = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, nullptr, false,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+		/* A new waiter swapped the tail, but has not linked itself yet */
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+			pause();
+		}
+	}
+	__atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
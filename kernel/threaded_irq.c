@@ -0,0 +1,151 @@
+#include "threaded_irq.h"
+
+#include "malloc.h"
+#include "proc.h"
+#include "rcu.h"
+#include "wait.h"
+
+#include "cpu/apic.h"
+#include "cpu/idt.h"
+#include "cpu/ioapic.h"
+
+#include <stdint.h>
+
+/* Read under RCU by the vector handler */
+static struct threaded_irq *threaded_irqs[256];
+
+/* Woken when a thread exits after threaded_irq_unregister() */
+static struct wait_queue exit_wq = WAIT_QUEUE_INIT(exit_wq);
+
+/* Mask the source first, so that a level triggered interrupt does not fire
+ * again as soon as it is acknowledged */
+static void threaded_irq_handler(struct interrupt_frame *frame) {
+	struct threaded_irq *irq = rcu_dereference(threaded_irqs[frame->vector]);
+	if (!irq) {
+		/* Being unregistered */
+		apic_eoi();
+		return;
+	}
+	irq->mask(irq);
+	apic_eoi();
+
+	__atomic_store_n(&irq->pending, true, __ATOMIC_RELEASE);
+	wake_one(&irq->wq);
+}
+
+static void threaded_irq_thread(void *data) {
+	struct threaded_irq *irq = data;
+	sched_set_highest();
+
+	for (;;) {
+		wait_event(&irq->wq, __atomic_load_n(&irq->pending, __ATOMIC_ACQUIRE)
+				|| __atomic_load_n(&irq->stop, __ATOMIC_ACQUIRE));
+		if (__atomic_load_n(&irq->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		__atomic_store_n(&irq->pending, false, __ATOMIC_RELAXED);
+		irq->func(irq->data);
+		irq->unmask(irq);
+	}
+
+	/* irq may be freed as soon as this is visible */
+	__atomic_store_n(&irq->running, false, __ATOMIC_RELEASE);
+	wake_all(&exit_wq);
+}
+
+static struct threaded_irq *threaded_irq_new(void (*func)(void *data),
+	void *data, void (*mask)(struct threaded_irq *irq),
+	void (*unmask)(struct threaded_irq *irq)) {
+	struct threaded_irq *irq = malloc(sizeof(struct threaded_irq));
+	irq->func = func;
+	irq->data = data;
+	irq->mask = mask;
+	irq->unmask = unmask;
+	irq->gsi = -1;
+	irq->isa = 0;
+	irq->pending = false;
+	irq->stop = false;
+	irq->running = true;
+	wait_queue_init(&irq->wq);
+	return irq;
+}
+
+/* Start the thread and publish the interrupt to the vector handler */
+static void threaded_irq_start(uint8_t vector, struct threaded_irq *irq) {
+	irq->vector = vector;
+	kthread_new(threaded_irq_thread, irq);
+	rcu_assign_pointer(threaded_irqs[vector], irq);
+	idt_register(vector, threaded_irq_handler);
+}
+
+/**
+ * @brief Register a threaded interrupt handler. The handler runs in a kernel
+ * thread that stays on the highest MLFQ level, with the source masked until it
+ * returns.
+ * @param vector The vector of the interrupt.
+ * @param func The handler.
+ * @param data This pointer is passed to the handler.
+ * @param mask Masks the source, called by the vector handler with irqs
+ * disabled, e.g. through MSI-X or the device itself.
+ * @param unmask Unmasks the source, called by the thread.
+ * @return The interrupt, freed by threaded_irq_unregister().
+ */
+struct threaded_irq *threaded_irq_register(uint8_t vector,
+	void (*func)(void *data), void *data,
+	void (*mask)(struct threaded_irq *irq),
+	void (*unmask)(struct threaded_irq *irq)) {
+	struct threaded_irq *irq = threaded_irq_new(func, data, mask, unmask);
+	threaded_irq_start(vector, irq);
+	return irq;
+}
+
+static void ioapic_mask_irq(struct threaded_irq *irq) {
+	ioapic_mask(irq->gsi, irq->isa);
+}
+
+static void ioapic_unmask_irq(struct threaded_irq *irq) {
+	ioapic_unmask(irq->gsi, irq->isa);
+}
+
+/**
+ * @brief Register a threaded interrupt handler for an IOAPIC pin, which is
+ * masked while the handler runs. The pin must be routed to the vector with
+ * ioapic_register_interrupt().
+ * @param vector The vector of the interrupt.
+ * @param gsi The Global System Interrupt. If negative, the GSI is determined
+ * from the isa.
+ * @param isa The ISA interrupt if the GSI is negative/not known.
+ * @param func The handler.
+ * @param data This pointer is passed to the handler.
+ * @return The interrupt, freed by threaded_irq_unregister().
+ */
+struct threaded_irq *threaded_irq_register_ioapic(uint8_t vector, int64_t gsi,
+	uint8_t isa, void (*func)(void *data), void *data) {
+	struct threaded_irq *irq
+		= threaded_irq_new(func, data, ioapic_mask_irq, ioapic_unmask_irq);
+	irq->gsi = gsi;
+	irq->isa = isa;
+	threaded_irq_start(vector, irq);
+	return irq;
+}
+
+/**
+ * @brief Remove a threaded interrupt handler and release its vector. Returns
+ * once the thread has exited, the source is left masked. Must be called from a
+ * thread other than the handler.
+ * @param irq The interrupt, freed before this returns.
+ */
+void threaded_irq_unregister(struct threaded_irq *irq) {
+	/* The vector handler ignores the interrupt from here on, the source is
+	 * masked again below in case the thread unmasks it in between */
+	irq->mask(irq);
+	rcu_assign_pointer(threaded_irqs[irq->vector], nullptr);
+	idt_unregister(irq->vector);
+
+	__atomic_store_n(&irq->stop, true, __ATOMIC_RELEASE);
+	wake_one(&irq->wq);
+	wait_event(&exit_wq, !__atomic_load_n(&irq->running, __ATOMIC_ACQUIRE));
+
+	irq->mask(irq);
+	free(irq);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "wait.h"
+
+#include <stdint.h>
+
+/**
+ * @struct threaded_irq
+ * @brief An interrupt whose handler runs in its own kernel thread. The vector
+ * handler only masks the source and wakes the thread, which unmasks the source
+ * again once the handler returned. Long handlers then do not delay other
+ * interrupts, and the handler may block.
+ */
+struct threaded_irq {
+	void (*func)(void *data); /* The handler, runs in the thread */
+	void *data;
+	void (*mask)(struct threaded_irq *irq);
+	void (*unmask)(struct threaded_irq *irq);
+	int64_t gsi; /* For the IOAPIC mask functions */
+	uint8_t isa;
+	uint8_t vector;
+	bool pending; /* Raised and the handler did not start yet */
+	bool stop; /* Set by threaded_irq_unregister() */
+	bool running; /* The thread did not exit yet */
+	struct wait_queue wq;
+};
+
+struct threaded_irq *threaded_irq_register(uint8_t vector,
+	void (*func)(void *data), void *data,
+	void (*mask)(struct threaded_irq *irq),
+	void (*unmask)(struct threaded_irq *irq));
+struct threaded_irq *threaded_irq_register_ioapic(uint8_t vector, int64_t gsi,
+	uint8_t isa, void (*func)(void *data), void *data);
+void threaded_irq_unregister(struct threaded_irq *irq);
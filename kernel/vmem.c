@@ -1,24 +1,326 @@
 #include "vmem.h"
 
-#include "malloc.h"
+#include "alloc_prof.h"
+#include "spinlock.h"
 
+#include "cpu/idt.h"
 #include "cpu/mem.h"
 #include "cpu/page.h"
+#include "util/hashtable.h"
+#include "util/list.h"
+#include "util/panic.h"
 #include "util/print.h"
+#include "util/rbtree.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
-struct vheap_header {
-	void *addr;
+/* The virtual heap is managed as a vmem arena (Bonwick, Adams: "Magazines and
+ * Vmem"). Every range of the heap is described by a boundary tag. Free tags are
+ * kept on power-of-two size class lists, allocated tags are hashed by their
+ * address, so both allocating and freeing a range take constant time. The hash
+ * table grows with the number of allocations up to a page of buckets.
+ *
+ * Allocated segments are additionally indexed as regions in two red-black
+ * trees: one sorted by address, which finds the region containing an address,
+ * and one sorted by the size of the gap preceding each region. Free segments
+ * are coalesced, so every gap is exactly one free segment and the gap tree
+ * finds the best fitting one when the size class lists have no instant fit. */
+
+#define VMEM_QUANTUM       (4'096)
+#define VMEM_QUANTUM_SHIFT (12)
+
+#define VMEM_FREELISTS (64)
+#define VMEM_HASH_BITS     (6)
+#define VMEM_HASH_MAX_BITS (9) /* A page of buckets */
+
+/* Ranges of up to VMEM_QCACHE_MAX quanta are cached on free instead of being
+ * returned to the arena */
+#define VMEM_QCACHE_MAX   (4)
+#define VMEM_QCACHE_DEPTH (16)
+
+enum vmem_seg_type {
+	VMEM_SEG_FREE,
+	VMEM_SEG_ALLOC
+};
+
+struct vmem_seg {
+	uint64_t base;
 	size_t size;
-	struct vheap_header *next;
+	enum vmem_seg_type type;
+	struct list_head segs; /* All segments, sorted by address */
+	struct list_head link; /* Free list or unused tag list */
+	struct hash_node hash; /* Allocated segments by base */
+
+	/* Region index, only used by allocated segments */
+	struct rb_node by_addr;
+	struct rb_node by_gap;
+	size_t gap; /* Unallocated space between the preceding region and this */
+	uint64_t flags;
+	enum vmem_backing backing;
+	bool cached; /* Freed into the quantum cache, still reserved */
 };
 
-/* pointer to the first allocated block of pages */
-static struct vheap_header *vheap_head = NULL;
+struct vmem_qcache {
+	void *addrs[VMEM_QCACHE_DEPTH];
+	size_t count;
+};
+
+static struct list_head vmem_segs = LIST_HEAD_INIT(vmem_segs);
+static struct list_head freelist[VMEM_FREELISTS];
+static uint64_t freemap; /* Bit n is set if freelist[n] is not empty */
+static struct hash_table allocated;
+static struct vmem_qcache qcache[VMEM_QCACHE_MAX];
+
+static struct list_head unused_tags = LIST_HEAD_INIT(unused_tags);
+
+static struct rb_root regions_by_addr = RB_ROOT_INIT;
+static struct rb_root regions_by_gap = RB_ROOT_INIT;
+
+/* Zero-sized region at the end of the virtual heap, its gap is the space after
+ * the last real region */
+static struct vmem_seg end_region;
+
 static void *vheap_start;
 static void *vheap_end;
 
+static struct spinlock vmem_lock = SPINLOCK_INIT;
+
+/**
+ * @brief Get an unused boundary tag. Tags are carved from whole pages accessed
+ * through the higher half mapping, so this never recurses into vmem_alloc().
+ */
+static struct vmem_seg *seg_get(void) {
+	if (list_empty(&unused_tags)) {
+		void *page = alloc_page();
+		if (!page) {
+			panic("Failed to allocate vmem boundary tags!");
+		}
+
+		struct vmem_seg *tags = P2V((struct vmem_seg *)page);
+		for (size_t i = 0; i < 4'096 / sizeof(*tags); ++i) {
+			list_add(&tags[i].link, &unused_tags);
+		}
+	}
+
+	struct vmem_seg *seg = list_entry(unused_tags.next, struct vmem_seg, link);
+	list_del(&seg->link);
+	return seg;
+}
+
+static void seg_put(struct vmem_seg *seg) {
+	list_add(&seg->link, &unused_tags);
+}
+
+static unsigned freelist_index(size_t size) {
+	return 63 - __builtin_clzll(size >> VMEM_QUANTUM_SHIFT);
+}
+
+static void freelist_insert(struct vmem_seg *seg) {
+	unsigned index = freelist_index(seg->size);
+	list_add(&seg->link, &freelist[index]);
+	freemap |= (uint64_t)1 << index;
+}
+
+static void freelist_remove(struct vmem_seg *seg) {
+	unsigned index = freelist_index(seg->size);
+	list_del(&seg->link);
+	if (list_empty(&freelist[index])) {
+		freemap &= ~((uint64_t)1 << index);
+	}
+}
+
+/* Bucket arrays are whole pages accessed through the higher half mapping, for
+ * the same reason as the tags */
+static struct hash_node **buckets_alloc([[maybe_unused]] uint8_t bits) {
+	void *page = alloc_page();
+	return page ? P2V(page) : nullptr;
+}
+
+static void buckets_free(struct hash_node **buckets,
+	[[maybe_unused]] uint8_t bits) {
+	free_page(V2P(buckets));
+}
+
+static struct vmem_seg *seg_lookup(uint64_t addr) {
+	struct hash_node *node = hash_lookup(&allocated, addr);
+	return node ? hash_entry(node, struct vmem_seg, hash) : nullptr;
+}
+
+/**
+ * @brief Find the free segment of at least size bytes that wastes the least
+ * space, through the gap tree.
+ */
+static struct vmem_seg *gap_best_fit(size_t size) {
+	struct vmem_seg *found = nullptr;
+	struct rb_node *node = regions_by_gap.node;
+	while (node) {
+		struct vmem_seg *seg = rb_entry(node, struct vmem_seg, by_gap);
+		if (seg->gap >= size) {
+			found = seg;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	if (!found) {
+		return nullptr;
+	}
+
+	/* end_region is not on vmem_segs, its gap is the last segment */
+	struct list_head *prev
+		= found == &end_region ? vmem_segs.prev : found->segs.prev;
+	struct vmem_seg *seg = list_entry(prev, struct vmem_seg, segs);
+	if (seg->type != VMEM_SEG_FREE || seg->base + seg->size != found->base) {
+		panic("vmem: the gap before 0x%w64X is not a free segment",
+			found->base);
+	}
+	return seg;
+}
+
+/**
+ * @brief Find a free segment of at least size bytes.
+ */
+static struct vmem_seg *seg_find(size_t size) {
+	unsigned min_index = freelist_index(size);
+	unsigned index = min_index;
+
+	/* Instant fit: every segment on the list of the next larger power of two
+	 * is big enough */
+	if (size & (size - 1)) {
+		++index;
+	}
+	uint64_t avail = index < 64 ? freemap & (~(uint64_t)0 << index) : 0;
+	if (avail) {
+		return list_entry(freelist[__builtin_ctzll(avail)].next,
+			struct vmem_seg, link);
+	}
+
+	/* Segments of size's own size class might still fit */
+	return index != min_index ? gap_best_fit(size) : nullptr;
+}
+
+static void *seg_alloc(size_t size) {
+	struct vmem_seg *seg = seg_find(size);
+	if (!seg) {
+		return nullptr;
+	}
+	freelist_remove(seg);
+
+	/* Split off the unused rest of the segment */
+	if (seg->size > size) {
+		struct vmem_seg *rest = seg_get();
+		rest->base = seg->base + size;
+		rest->size = seg->size - size;
+		rest->type = VMEM_SEG_FREE;
+		list_add(&rest->segs, &seg->segs);
+		freelist_insert(rest);
+
+		seg->size = size;
+	}
+
+	seg->type = VMEM_SEG_ALLOC;
+	seg->cached = false;
+	hash_insert(&allocated, &seg->hash, seg->base);
+	return (void *)seg->base;
+}
+
+static void seg_free(struct vmem_seg *seg) {
+	hash_remove(&allocated, &seg->hash);
+	seg->type = VMEM_SEG_FREE;
+
+	/* Coalesce with the following segment */
+	if (seg->segs.next != &vmem_segs) {
+		struct vmem_seg *next = list_next(seg, segs);
+		if (next->type == VMEM_SEG_FREE
+			&& seg->base + seg->size == next->base) {
+			freelist_remove(next);
+			seg->size += next->size;
+			list_del(&next->segs);
+			seg_put(next);
+		}
+	}
+
+	/* Coalesce with the preceding segment */
+	if (seg->segs.prev != &vmem_segs) {
+		struct vmem_seg *prev
+			= list_entry(seg->segs.prev, struct vmem_seg, segs);
+		if (prev->type == VMEM_SEG_FREE
+			&& prev->base + prev->size == seg->base) {
+			freelist_remove(prev);
+			prev->size += seg->size;
+			list_del(&seg->segs);
+			seg_put(seg);
+			seg = prev;
+		}
+	}
+
+	freelist_insert(seg);
+}
+
+static void gap_insert(struct vmem_seg *seg) {
+	struct rb_node **link = &regions_by_gap.node;
+	struct rb_node *parent = nullptr;
+	while (*link) {
+		struct vmem_seg *cur = rb_entry(*link, struct vmem_seg, by_gap);
+		parent = *link;
+		if (seg->gap < cur->gap
+			|| (seg->gap == cur->gap && seg->base < cur->base)) {
+			link = &parent->left;
+		} else {
+			link = &parent->right;
+		}
+	}
+	rb_link_node(&seg->by_gap, parent, link);
+	rb_insert(&regions_by_gap, &seg->by_gap, nullptr);
+}
+
+/**
+ * @brief Change the gap preceding a region and requeue it in the gap tree.
+ */
+static void region_set_gap(struct vmem_seg *seg, size_t gap) {
+	rb_erase(&regions_by_gap, &seg->by_gap, nullptr);
+	seg->gap = gap;
+	gap_insert(seg);
+}
+
+static void region_insert(struct vmem_seg *seg) {
+	struct rb_node **link = &regions_by_addr.node;
+	struct rb_node *parent = nullptr;
+	while (*link) {
+		struct vmem_seg *cur = rb_entry(*link, struct vmem_seg, by_addr);
+		parent = *link;
+		link = seg->base < cur->base ? &parent->left : &parent->right;
+	}
+
+	/* There always is a next region because of end_region */
+	struct vmem_seg *next;
+	if (link == &parent->left) {
+		next = rb_entry(parent, struct vmem_seg, by_addr);
+	} else {
+		next = rb_entry(rb_next(parent), struct vmem_seg, by_addr);
+	}
+	seg->gap = seg->base - (next->base - next->gap);
+	seg->flags = 0;
+	seg->backing = VMEM_BACKING_NONE;
+
+	rb_link_node(&seg->by_addr, parent, link);
+	rb_insert(&regions_by_addr, &seg->by_addr, nullptr);
+	gap_insert(seg);
+
+	region_set_gap(next, next->base - (seg->base + seg->size));
+}
+
+static void region_remove(struct vmem_seg *seg) {
+	struct vmem_seg *next
+		= rb_entry(rb_next(&seg->by_addr), struct vmem_seg, by_addr);
+
+	rb_erase(&regions_by_addr, &seg->by_addr, nullptr);
+	rb_erase(&regions_by_gap, &seg->by_gap, nullptr);
+
+	region_set_gap(next, next->gap + seg->size + seg->gap);
+}
+
 /**
  * @brief Initialize the heap of virtual memory/pages.
  */
@@ -32,93 +334,169 @@ void vmem_init(void) {
 				: 0);
 	vheap_end = (void *)KERNEL_BASE;
 
-	vheap_head = malloc(sizeof(*vheap_head));
+	for (size_t i = 0; i < VMEM_FREELISTS; ++i) {
+		init_list_head(&freelist[i]);
+	}
+	hash_init(&allocated, VMEM_HASH_BITS, VMEM_HASH_MAX_BITS, buckets_alloc,
+		buckets_free);
+
+	/* The whole virtual heap starts out as a single free segment */
+	struct vmem_seg *seg = seg_get();
+	seg->base = (uint64_t)vheap_start;
+	seg->size = (size_t)(vheap_end - vheap_start) & ~(VMEM_QUANTUM - 1);
+	seg->type = VMEM_SEG_FREE;
+	list_add(&seg->segs, &vmem_segs);
+	freelist_insert(seg);
+
+	end_region.base = seg->base + seg->size;
+	end_region.size = 0;
+	end_region.type = VMEM_SEG_ALLOC;
+	end_region.gap = seg->size;
+	rb_link_node(&end_region.by_addr, nullptr, &regions_by_addr.node);
+	rb_insert(&regions_by_addr, &end_region.by_addr, nullptr);
+	gap_insert(&end_region);
 
-	vheap_head->addr = (void *)vheap_start;
-	vheap_head->size = 0;
-	vheap_head->next = nullptr;
 	kprint("Initializing virtual heap: Success\n");
 }
 
 /**
  * @brief Allocate a range of pages in the higher half of virtual memory.
  * @param size The size of the range to allocate.
- * @return The address of the allocated range.
+ * @return The address of the allocated range or nullptr if the virtual heap is
+ * exhausted.
  */
 void *vmem_alloc(size_t size) {
 	/* make size a multiple of 4096 for ease of use */
-	size += (size % 4'096 != 0) ? (4'096 - size % 4'096) : 0;
-	struct vheap_header *current = vheap_head;
-
-	if (current->size == 0) {
-		current->size = size;
-		return current->addr;
-	}
-
-	/* Is there enough space at the start of the virtual heap? */
-	if ((size_t)(vheap_head->addr - vheap_start) >= size) {
-		vheap_head = malloc(sizeof(*vheap_head));
-		vheap_head->addr = vheap_start;
-		vheap_head->size = size;
-		vheap_head->next = current;
-		return vheap_head->addr;
+	size += (size % VMEM_QUANTUM != 0) ? (VMEM_QUANTUM - size % VMEM_QUANTUM)
+	                                   : 0;
+	if (size == 0) {
+		return nullptr;
 	}
+	spin_lock_irqsave(&vmem_lock);
 
-	while (current->next != nullptr) {
-		if ((size_t)current->next->addr - ((size_t)current->addr + current->size)
-			>= size) {
-			struct vheap_header *temp = current->next;
-
-			current->next = malloc(sizeof(*current));
-			current->next->addr = current->addr + current->size;
-			current->next->size = size;
-			current->next->next = temp;
-
-			return current->next->addr;
-		}
-		current = current->next;
+	void *addr;
+	size_t quanta = size >> VMEM_QUANTUM_SHIFT;
+	if (quanta <= VMEM_QCACHE_MAX && qcache[quanta - 1].count) {
+		/* Cached ranges never left the region index */
+		struct vmem_qcache *cache = &qcache[quanta - 1];
+		addr = cache->addrs[--cache->count];
+		seg_lookup((uint64_t)addr)->cached = false;
+	} else if ((addr = seg_alloc(size))) {
+		region_insert(seg_lookup((uint64_t)addr));
 	}
 
-	/* current->next == nullptr */
-	if ((size_t)vheap_end - ((size_t)current->addr + current->size) >= size) {
-		current->next = malloc(sizeof(*current));
-		current->next->addr = current->addr + current->size;
-		current->next->size = size;
-		current->next->next = nullptr;
+	spin_unlock_irqrestore(&vmem_lock);
 
-		return current->next->addr;
+	if (addr) {
+		ALLOC_PROF_RECORD(ALLOC_VMEM, addr, size);
 	}
-
-	return nullptr;
+	return addr;
 }
 
 /**
  * @brief Free a range of pages in the higher half of virtual memory.
- * @param addr The address of the range to allocate.
+ * @param addr The address of the range to free.
  */
 void vmem_free(void *addr) {
 	if (addr == nullptr) {
 		return;
 	}
+	ALLOC_PROF_RELEASE(ALLOC_VMEM, addr);
 
-	struct vheap_header *temp;
+	spin_lock_irqsave(&vmem_lock);
 
-	/* should we free the first block? */
-	if (vheap_head->addr == addr) {
-		temp = vheap_head;
-		vheap_head = vheap_head->next;
-		free(temp);
-		return;
+	struct vmem_seg *seg = seg_lookup((uint64_t)addr);
+	if (!seg) {
+		panic("vmem_free(): 0x%p was never allocated!", addr);
+	}
+	if (seg->cached) {
+		panic("vmem_free(): 0x%p was already freed!", addr);
+	}
+
+	/* Small ranges stay allocated in the arena and in the region index, so
+	 * their space is not reported as a gap, and are handed out again by
+	 * vmem_alloc() without splitting or coalescing */
+	size_t quanta = seg->size >> VMEM_QUANTUM_SHIFT;
+	if (quanta <= VMEM_QCACHE_MAX
+		&& qcache[quanta - 1].count < VMEM_QCACHE_DEPTH) {
+		struct vmem_qcache *cache = &qcache[quanta - 1];
+		cache->addrs[cache->count++] = addr;
+		seg->cached = true;
+		seg->flags = 0;
+		seg->backing = VMEM_BACKING_NONE;
+	} else {
+		region_remove(seg);
+		seg_free(seg);
+	}
+
+	spin_unlock_irqrestore(&vmem_lock);
+}
+
+/**
+ * @brief Set the attributes of an allocated range of virtual memory.
+ * @param addr The address of the range as returned by vmem_alloc().
+ * @param flags The page flags the range is mapped with.
+ * @param backing What kind of memory the range is mapped to.
+ */
+void vmem_set_region(void *addr, uint64_t flags, enum vmem_backing backing) {
+	spin_lock_irqsave(&vmem_lock);
+	struct vmem_seg *seg = seg_lookup((uint64_t)addr);
+	if (seg && !seg->cached) {
+		seg->flags = flags;
+		seg->backing = backing;
 	}
+	spin_unlock_irqrestore(&vmem_lock);
+}
 
-	struct vheap_header *current = vheap_head;
-	while (current->next != nullptr) {
-		if ((void *)current->next->addr == addr) {
-			temp = current->next;
-			current->next = current->next->next;
-			free(temp);
-			return;
+static bool region_lookup(const void *addr, struct vmem_region *region) {
+	uint64_t virt = (uint64_t)addr;
+	struct rb_node *node = regions_by_addr.node;
+	while (node) {
+		struct vmem_seg *seg = rb_entry(node, struct vmem_seg, by_addr);
+		if (virt < seg->base) {
+			node = node->left;
+		} else if (virt >= seg->base + seg->size) {
+			node = node->right;
+		} else {
+			*region = (struct vmem_region) {.start = (void *)seg->base,
+				.size = seg->size,
+				.flags = seg->flags,
+				.backing = seg->backing};
+			return !seg->cached;
 		}
-		current = current->next;
 	}
+	return false;
+}
+
+/**
+ * @brief Find the allocated range of virtual memory containing an address.
+ * @param addr The address to look up.
+ * @param region Filled with the range's description if it was found.
+ * @return Whether or not addr lies in an allocated range.
+ */
+bool vmem_find_region(const void *addr, struct vmem_region *region) {
+	spin_lock_irqsave(&vmem_lock);
+	bool found = region_lookup(addr, region);
+	spin_unlock_irqrestore(&vmem_lock);
+	return found;
+}
+
+/**
+ * @brief Like vmem_find_region(), but gives up instead of waiting if the
+ * virtual heap is locked. For exception handlers, which may have interrupted
+ * the holder of the lock on their own processor.
+ * @param addr The address to look up.
+ * @param region Filled with the range's description if it was found.
+ * @return Whether addr lies in an allocated range, false if the virtual heap
+ * was locked.
+ */
+bool vmem_try_find_region(const void *addr, struct vmem_region *region) {
+	irq_disable();
+	if (!spin_trylock(&vmem_lock)) {
+		irq_enable();
+		return false;
+	}
+	bool found = region_lookup(addr, region);
+	spin_unlock_irqrestore(&vmem_lock);
+	return found;
 }
@@ -1,7 +1,33 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @enum vmem_backing
+ * @brief The kind of memory a range of virtual memory is mapped to.
+ */
+enum vmem_backing {
+	VMEM_BACKING_NONE,
+	VMEM_BACKING_RAM,
+	VMEM_BACKING_MMIO
+};
+
+/**
+ * @struct vmem_region
+ * @brief Description of an allocated range of virtual memory.
+ */
+struct vmem_region {
+	void *start;
+	size_t size;
+	uint64_t flags;
+	enum vmem_backing backing;
+};
 
 void vmem_init(void);
 void *vmem_alloc(size_t size);
 void vmem_free(void *addr);
+
+void vmem_set_region(void *addr, uint64_t flags, enum vmem_backing backing);
+bool vmem_find_region(const void *addr, struct vmem_region *region);
+bool vmem_try_find_region(const void *addr, struct vmem_region *region);
@@ -0,0 +1,104 @@
+#include "wait.h"
+
+#include "proc.h"
+#include "spinlock.h"
+
+#include "cpu/idt.h"
+#include "util/list.h"
+
+/**
+ * @brief Initialize an empty wait queue.
+ * @param wq The wait queue to initialize.
+ */
+void wait_queue_init(struct wait_queue *wq) {
+	wq->lock = (struct spinlock)SPINLOCK_INIT;
+	init_list_head(&wq->waiters);
+}
+
+/**
+ * @brief Queue the current thread on a wait queue and mark it blocked. Disables
+ * irqs until wait_finish(), so a wakeup in between is not lost.
+ * @param wq The wait queue to wait on.
+ */
+void wait_prepare(struct wait_queue *wq) {
+	irq_disable();
+	struct thread *t = thread_current();
+
+	spin_lock(&wq->lock);
+	if (list_empty(&t->wait_list)) {
+		list_add_tail(&t->wait_list, &wq->waiters);
+	}
+	__atomic_store_n(&t->state, THREAD_BLOCKED, __ATOMIC_RELAXED);
+	spin_unlock(&wq->lock);
+}
+
+/**
+ * @brief Block after wait_prepare() or cancel the wait, e.g. because the
+ * condition became true in between.
+ * @param wq The wait queue passed to wait_prepare().
+ * @param block Whether to block until woken.
+ */
+void wait_finish(struct wait_queue *wq, bool block) {
+	struct thread *t = thread_current();
+
+	if (!block) {
+		spin_lock(&wq->lock);
+		bool queued = !list_empty(&t->wait_list);
+		if (queued) {
+			list_del(&t->wait_list);
+			init_list_head(&t->wait_list);
+			__atomic_store_n(&t->state, THREAD_RUNNING, __ATOMIC_RELAXED);
+		}
+		spin_unlock(&wq->lock);
+
+		/* Otherwise a waker already took the thread off the queue and is
+		 * about to make it runnable, which has to be waited for */
+		block = !queued;
+	}
+
+	if (block) {
+		thread_block();
+	}
+	irq_enable();
+}
+
+/* Must be called with wq->lock held */
+static struct thread *dequeue_waiter(struct wait_queue *wq) {
+	if (list_empty(&wq->waiters)) {
+		return nullptr;
+	}
+	struct thread *t = list_entry(wq->waiters.next, struct thread, wait_list);
+	list_del(&t->wait_list);
+	init_list_head(&t->wait_list);
+	return t;
+}
+
+/**
+ * @brief Wake the thread that has waited the longest.
+ * @param wq The wait queue.
+ * @return Whether a thread was woken.
+ */
+bool wake_one(struct wait_queue *wq) {
+	spin_lock_irqsave(&wq->lock);
+	struct thread *t = dequeue_waiter(wq);
+	spin_unlock(&wq->lock);
+
+	if (t) {
+		thread_wake(t);
+	}
+	irq_enable();
+	return t;
+}
+
+/**
+ * @brief Wake all threads waiting on a wait queue.
+ * @param wq The wait queue.
+ */
+void wake_all(struct wait_queue *wq) {
+	spin_lock_irqsave(&wq->lock);
+	struct thread *t;
+	while ((t = dequeue_waiter(wq))) {
+		thread_wake(t);
+	}
+	spin_unlock_irqrestore(&wq->lock);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "spinlock.h"
+
+#include "util/list.h"
+
+/**
+ * @struct wait_queue
+ * @brief Threads blocked until an event happens.
+ */
+struct wait_queue {
+	struct spinlock lock;
+	struct list_head waiters;
+};
+
+/**
+ * @def WAIT_QUEUE_INIT(name)
+ * @brief Statically initialize an empty wait queue.
+ */
+#define WAIT_QUEUE_INIT(name) {SPINLOCK_INIT, LIST_HEAD_INIT((name).waiters)}
+
+void wait_queue_init(struct wait_queue *wq);
+
+void wait_prepare(struct wait_queue *wq);
+void wait_finish(struct wait_queue *wq, bool block);
+
+bool wake_one(struct wait_queue *wq);
+void wake_all(struct wait_queue *wq);
+
+/**
+ * @def wait_event(wq, cond)
+ * @brief Block the current thread until cond is true. cond is evaluated again
+ * every time the thread is woken through wq, so whoever makes it true must call
+ * wake_one() or wake_all() afterwards.
+ * @param wq The wait queue to wait on.
+ * @param cond The condition to wait for.
+ */
+#define wait_event(wq, cond)            \
+	do {                                \
+		while (!(cond)) {               \
+			wait_prepare(wq);           \
+			wait_finish(wq, !(cond));   \
+		}                               \
+	} while (0)
@@ -0,0 +1,89 @@
+#include "workqueue.h"
+
+#include "malloc.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "wait.h"
+
+#include "cpu/smp.h"
+#include "util/list.h"
+#include "util/panic.h"
+
+struct workqueue *system_wq;
+
+static void worker_thread(void *data) {
+	struct workqueue *wq = data;
+	for (;;) {
+		wait_event(&wq->wait, !list_empty(&wq->works));
+
+		spin_lock_irqsave(&wq->lock);
+		if (list_empty(&wq->works)) {
+			/* Another worker was faster */
+			spin_unlock_irqrestore(&wq->lock);
+			continue;
+		}
+		struct work *work = list_entry(wq->works.next, struct work, list);
+		list_del(&work->list);
+		/* Cleared before it runs, so it can be queued again meanwhile */
+		work->pending = false;
+		spin_unlock_irqrestore(&wq->lock);
+
+		work->func(work);
+	}
+}
+
+/**
+ * @brief Create a workqueue with its own worker threads.
+ * @param threads The number of workers, at least 1. Work items run in parallel
+ * on up to this many processors.
+ * @return The workqueue, it is never destroyed. nullptr if there is no memory
+ * left.
+ */
+struct workqueue *workqueue_new(unsigned threads) {
+	if (!threads) {
+		panic("workqueue_new(): a workqueue needs at least one thread");
+	}
+
+	struct workqueue *wq = malloc(sizeof(struct workqueue));
+	if (!wq) {
+		return nullptr;
+	}
+	wq->lock = (struct spinlock)SPINLOCK_INIT;
+	init_list_head(&wq->works);
+	wait_queue_init(&wq->wait);
+	for (unsigned i = 0; i < threads; ++i) {
+		kthread_new(worker_thread, wq);
+	}
+	return wq;
+}
+
+/**
+ * @brief Create the system workqueue.
+ */
+void workqueue_init(void) {
+	system_wq = workqueue_new(cpu_count);
+	if (!system_wq) {
+		panic("Failed to create the system workqueue!");
+	}
+}
+
+/**
+ * @brief Run a work item in a worker thread of a workqueue. Can be called from
+ * any context, including interrupt handlers and softirqs.
+ * @param wq The workqueue.
+ * @param work The work item.
+ * @return Whether it was queued, false if it was still pending.
+ */
+bool queue_work(struct workqueue *wq, struct work *work) {
+	spin_lock_irqsave(&wq->lock);
+	if (work->pending) {
+		spin_unlock_irqrestore(&wq->lock);
+		return false;
+	}
+	work->pending = true;
+	list_add_tail(&work->list, &wq->works);
+	spin_unlock_irqrestore(&wq->lock);
+
+	wake_one(&wq->wait);
+	return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "spinlock.h"
+#include "wait.h"
+
+#include "util/list.h"
+
+/**
+ * @struct work
+ * @brief Deferred work that runs in a thread of a workqueue and may block.
+ */
+struct work {
+	struct list_head list;
+	void (*func)(struct work *work);
+	bool pending; /* Queued and not started yet */
+};
+
+/**
+ * @def WORK_INIT(func)
+ * @brief Statically initialize a work item.
+ * @param func The function to run, it gets the work item as argument.
+ */
+#define WORK_INIT(func) {{nullptr, nullptr}, (func), false}
+
+/**
+ * @struct workqueue
+ * @brief Work items waiting for one of the worker threads of the queue, run in
+ * the order they were queued.
+ */
+struct workqueue {
+	struct spinlock lock;
+	struct list_head works;
+	struct wait_queue wait; /* Idle workers */
+};
+
+extern struct workqueue *system_wq;
+
+void workqueue_init(void);
+struct workqueue *workqueue_new(unsigned threads);
+
+bool queue_work(struct workqueue *wq, struct work *work);
+
+/**
+ * @brief Queue work on the system workqueue, which has a worker per processor.
+ * @param work The work item.
+ * @return Whether it was queued, false if it was still pending.
+ */
+static inline bool schedule_work(struct work *work) {
+	return queue_work(system_wq, work);
+}
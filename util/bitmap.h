@@ -0,0 +1,218 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bitmaps are arrays of 64 bit words, bit n is bit n % 64 of word n / 64. Scans
+ * look at a whole word per step and locate the bit with tzcnt or lzcnt. Bits
+ * past the size in the last word are ignored. The plain operations are not
+ * atomic, the _atomic ones can be used on a bitmap shared without a lock. */
+
+#define BITMAP_WORD_BITS (64)
+
+/**
+ * @def BITMAP_WORDS(bits)
+ * @brief The number of words of a bitmap of a number of bits.
+ */
+#define BITMAP_WORDS(bits) (((bits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+static inline uint64_t bitmap_mask(size_t bit) {
+	return (uint64_t)1 << (bit % BITMAP_WORD_BITS);
+}
+
+static inline bool bitmap_test(const uint64_t *map, size_t bit) {
+	return map[bit / BITMAP_WORD_BITS] & bitmap_mask(bit);
+}
+
+static inline void bitmap_set(uint64_t *map, size_t bit) {
+	map[bit / BITMAP_WORD_BITS] |= bitmap_mask(bit);
+}
+
+static inline void bitmap_clear(uint64_t *map, size_t bit) {
+	map[bit / BITMAP_WORD_BITS] &= ~bitmap_mask(bit);
+}
+
+/* Scans for a set bit in map XOR invert, from start up to size */
+static inline size_t bitmap_scan(const uint64_t *map, size_t size,
+	size_t start, uint64_t invert) {
+	if (start >= size) {
+		return size;
+	}
+
+	size_t index = start / BITMAP_WORD_BITS;
+	uint64_t word = (map[index] ^ invert) & ~(bitmap_mask(start) - 1);
+	while (!word) {
+		if (++index >= BITMAP_WORDS(size)) {
+			return size;
+		}
+		word = map[index] ^ invert;
+	}
+
+	size_t bit = index * BITMAP_WORD_BITS + __builtin_ctzll(word);
+	return bit < size ? bit : size;
+}
+
+/**
+ * @brief Find the first set bit at or after a position.
+ * @param map The bitmap.
+ * @param size The number of bits of the bitmap.
+ * @param start The position to start at.
+ * @return The position of the bit or size if there is none.
+ */
+static inline size_t bitmap_find_next_set(const uint64_t *map, size_t size,
+	size_t start) {
+	return bitmap_scan(map, size, start, 0);
+}
+
+/**
+ * @brief Find the first clear bit at or after a position.
+ * @param map The bitmap.
+ * @param size The number of bits of the bitmap.
+ * @param start The position to start at.
+ * @return The position of the bit or size if there is none.
+ */
+static inline size_t bitmap_find_next_zero(const uint64_t *map, size_t size,
+	size_t start) {
+	return bitmap_scan(map, size, start, UINT64_MAX);
+}
+
+static inline size_t bitmap_find_first_set(const uint64_t *map, size_t size) {
+	return bitmap_scan(map, size, 0, 0);
+}
+
+static inline size_t bitmap_find_first_zero(const uint64_t *map, size_t size) {
+	return bitmap_scan(map, size, 0, UINT64_MAX);
+}
+
+/**
+ * @brief Find the last set bit.
+ * @param map The bitmap.
+ * @param size The number of bits of the bitmap.
+ * @return The position of the bit or size if there is none.
+ */
+static inline size_t bitmap_find_last_set(const uint64_t *map, size_t size) {
+	size_t index = BITMAP_WORDS(size);
+	/* Only the bits below size in the last word */
+	uint64_t word
+		= size % BITMAP_WORD_BITS ? bitmap_mask(size) - 1 : UINT64_MAX;
+	while (index--) {
+		word &= map[index];
+		if (word) {
+			return index * BITMAP_WORD_BITS + (BITMAP_WORD_BITS - 1)
+				- __builtin_clzll(word);
+		}
+		word = UINT64_MAX;
+	}
+	return size;
+}
+
+/**
+ * @brief Find a run of clear bits.
+ * @param map The bitmap.
+ * @param size The number of bits of the bitmap.
+ * @param count The length of the run, at least 1.
+ * @return The position of the first run that is long enough or size if there
+ * is none.
+ */
+static inline size_t bitmap_find_zero_range(const uint64_t *map, size_t size,
+	size_t count) {
+	size_t start = bitmap_find_first_zero(map, size);
+	while (start < size && count <= size - start) {
+		/* Looks for a set bit only within the candidate run */
+		size_t end = bitmap_find_next_set(map, start + count, start);
+		if (end == start + count) {
+			return start;
+		}
+		start = bitmap_find_next_zero(map, size, end);
+	}
+	return size;
+}
+
+/**
+ * @brief Set a range of bits.
+ * @param map The bitmap.
+ * @param start The first bit.
+ * @param count The number of bits.
+ */
+static inline void bitmap_set_range(uint64_t *map, size_t start, size_t count) {
+	uint64_t *word = &map[start / BITMAP_WORD_BITS];
+	size_t bits = BITMAP_WORD_BITS - start % BITMAP_WORD_BITS;
+	uint64_t mask = ~(bitmap_mask(start) - 1);
+	while (count >= bits) {
+		*word++ |= mask;
+		count -= bits;
+		bits = BITMAP_WORD_BITS;
+		mask = UINT64_MAX;
+	}
+	if (count) {
+		*word |= mask & (bitmap_mask(BITMAP_WORD_BITS - bits + count) - 1);
+	}
+}
+
+/**
+ * @brief Clear a range of bits.
+ * @param map The bitmap.
+ * @param start The first bit.
+ * @param count The number of bits.
+ */
+static inline void bitmap_clear_range(uint64_t *map, size_t start,
+	size_t count) {
+	uint64_t *word = &map[start / BITMAP_WORD_BITS];
+	size_t bits = BITMAP_WORD_BITS - start % BITMAP_WORD_BITS;
+	uint64_t mask = ~(bitmap_mask(start) - 1);
+	while (count >= bits) {
+		*word++ &= ~mask;
+		count -= bits;
+		bits = BITMAP_WORD_BITS;
+		mask = UINT64_MAX;
+	}
+	if (count) {
+		*word &= ~(mask & (bitmap_mask(BITMAP_WORD_BITS - bits + count) - 1));
+	}
+}
+
+/**
+ * @brief Set a bit atomically.
+ * @return Whether the bit was already set.
+ */
+static inline bool bitmap_test_and_set_atomic(uint64_t *map, size_t bit) {
+	uint64_t mask = bitmap_mask(bit);
+	return __atomic_fetch_or(&map[bit / BITMAP_WORD_BITS], mask,
+		__ATOMIC_ACQUIRE) & mask;
+}
+
+/**
+ * @brief Clear a bit atomically. Writes before are visible to whoever sets the
+ * bit next.
+ * @return Whether the bit was set.
+ */
+static inline bool bitmap_test_and_clear_atomic(uint64_t *map, size_t bit) {
+	uint64_t mask = bitmap_mask(bit);
+	return __atomic_fetch_and(&map[bit / BITMAP_WORD_BITS], ~mask,
+		__ATOMIC_RELEASE) & mask;
+}
+
+/**
+ * @brief Find a clear bit and set it atomically, to hand out ids or slots
+ * without a lock. Free them with bitmap_test_and_clear_atomic().
+ * @param map The bitmap.
+ * @param size The number of bits of the bitmap.
+ * @return The position of the bit or size if all bits are set.
+ */
+static inline size_t bitmap_alloc_atomic(uint64_t *map, size_t size) {
+	for (size_t index = 0; index < BITMAP_WORDS(size); ++index) {
+		uint64_t word = __atomic_load_n(&map[index], __ATOMIC_RELAXED);
+		while (~word) {
+			size_t bit = index * BITMAP_WORD_BITS + __builtin_ctzll(~word);
+			if (bit >= size) {
+				return size;
+			}
+			if (__atomic_compare_exchange_n(&map[index], &word,
+				word | bitmap_mask(bit), true, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED)) {
+				return bit;
+			}
+		}
+	}
+	return size;
+}
@@ -0,0 +1,133 @@
+#include "hashtable.h"
+
+#include "panic.h"
+#include "string.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+static void link_node(struct hash_node **bucket, struct hash_node *node) {
+	node->next = *bucket;
+	if (node->next) {
+		node->next->pprev = &node->next;
+	}
+	node->pprev = bucket;
+	*bucket = node;
+}
+
+/**
+ * @brief Move all nodes into a bucket array of 1 << bits entries. Keeps the
+ * current array if the new one cannot be allocated, which only makes the
+ * chains longer.
+ */
+static void hash_resize(struct hash_table *table, uint8_t bits) {
+	struct hash_node **buckets = table->alloc(bits);
+	if (!buckets) {
+		return;
+	}
+	memset(buckets, 0, sizeof(*buckets) << bits);
+
+	for (size_t i = 0; i < (size_t)1 << table->bits; ++i) {
+		struct hash_node *node = table->buckets[i];
+		while (node) {
+			struct hash_node *next = node->next;
+			link_node(&buckets[hash_u64(node->key, bits)], node);
+			node = next;
+		}
+	}
+
+	table->free(table->buckets, table->bits);
+	table->buckets = buckets;
+	table->bits = bits;
+}
+
+/**
+ * @brief Initialize an empty hash table.
+ * @param table The table.
+ * @param bits The initial size of the bucket array as a power of two.
+ * @param max_bits The size as a power of two beyond which it does not grow.
+ * @param alloc Allocates bucket arrays, must succeed for the initial one.
+ * @param free Frees bucket arrays.
+ */
+void hash_init(struct hash_table *table, uint8_t bits, uint8_t max_bits,
+	hash_alloc alloc, hash_free free) {
+	if (!bits || bits > max_bits || max_bits > 63) {
+		panic("hash_init(): invalid size %w8u, max %w8u", bits, max_bits);
+	}
+
+	table->buckets = alloc(bits);
+	if (!table->buckets) {
+		panic("hash_init(): failed to allocate the buckets");
+	}
+	memset(table->buckets, 0, sizeof(*table->buckets) << bits);
+	table->bits = bits;
+	table->max_bits = max_bits;
+	table->count = 0;
+	table->alloc = alloc;
+	table->free = free;
+}
+
+/**
+ * @brief Add a node to a hash table. There may already be nodes with the same
+ * key, the new node is found first.
+ * @param table The table.
+ * @param node The node, not in any table.
+ * @param key The key of the node.
+ */
+void hash_insert(struct hash_table *table, struct hash_node *node,
+	uint64_t key) {
+	node->key = key;
+	link_node(&table->buckets[hash_u64(key, table->bits)], node);
+
+	if (++table->count > (size_t)HASH_MAX_LOAD << table->bits
+		&& table->bits < table->max_bits) {
+		hash_resize(table, table->bits + 1);
+	}
+}
+
+/**
+ * @brief Remove a node from its hash table. The bucket array never shrinks.
+ * @param table The table.
+ * @param node The node.
+ */
+void hash_remove(struct hash_table *table, struct hash_node *node) {
+	*node->pprev = node->next;
+	if (node->next) {
+		node->next->pprev = node->pprev;
+	}
+	node->next = nullptr;
+	node->pprev = nullptr;
+	--table->count;
+}
+
+/**
+ * @brief Find a node in a hash table.
+ * @param table The table.
+ * @param key The key.
+ * @return The most recently inserted node with the key, nullptr if there is
+ * none.
+ */
+struct hash_node *hash_lookup(const struct hash_table *table, uint64_t key) {
+	struct hash_node *node = table->buckets[hash_u64(key, table->bits)];
+	for (; node; node = node->next) {
+		if (node->key == key) {
+			return node;
+		}
+	}
+	return nullptr;
+}
+
+/**
+ * @brief Get the next node with the same key as a node.
+ * @param node A node returned by hash_lookup() or hash_next().
+ * @return The node or nullptr if there is none.
+ */
+struct hash_node *hash_next(const struct hash_node *node) {
+	uint64_t key = node->key;
+	for (node = node->next; node; node = node->next) {
+		if (node->key == key) {
+			return (struct hash_node *)node;
+		}
+	}
+	return nullptr;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An intrusive chained hash table keyed by 64 bit integers. The bucket array
+ * doubles whenever the table holds more than HASH_MAX_LOAD entries per bucket,
+ * up to a limit chosen by the user. The table is not synchronized, the caller
+ * serializes all accesses. */
+
+#define HASH_MAX_LOAD (2)
+
+struct hash_node {
+	struct hash_node *next;
+	struct hash_node **pprev; /* The pointer that points to this node */
+	uint64_t key;
+};
+
+/**
+ * @brief Callback that allocates a bucket array of 1 << bits entries. Returns
+ * nullptr if there is no memory, which leaves the table at its current size.
+ */
+typedef struct hash_node **(*hash_alloc)(uint8_t bits);
+
+/**
+ * @brief Callback that frees a bucket array returned by hash_alloc.
+ */
+typedef void (*hash_free)(struct hash_node **buckets, uint8_t bits);
+
+struct hash_table {
+	struct hash_node **buckets;
+	uint8_t bits;
+	uint8_t max_bits;
+	size_t count;
+	hash_alloc alloc;
+	hash_free free;
+};
+
+/**
+ * @def hash_entry(ptr, type, member)
+ * @brief Get the struct for this node.
+ * @param ptr The ptr to the node.
+ * @param type The type of the struct this is embedded in.
+ * @param member The name of the hash_node within the struct.
+ */
+#define hash_entry(ptr, type, member) \
+	((type *)((void *)(ptr) - offsetof(type, member)))
+
+/**
+ * @brief Hash a 64 bit integer to a number of bits. Fibonacci hashing, the top
+ * bits of the product are mixed the best, so aligned keys spread well too.
+ * @param key The key.
+ * @param bits The number of bits of the result, 1 to 63.
+ */
+static inline uint64_t hash_u64(uint64_t key, uint8_t bits) {
+	return (key * 0x9e37'79b9'7f4a'7c15) >> (64 - bits);
+}
+
+void hash_init(struct hash_table *table, uint8_t bits, uint8_t max_bits,
+	hash_alloc alloc, hash_free free);
+void hash_insert(struct hash_table *table, struct hash_node *node,
+	uint64_t key);
+void hash_remove(struct hash_table *table, struct hash_node *node);
+struct hash_node *hash_lookup(const struct hash_table *table, uint64_t key);
+struct hash_node *hash_next(const struct hash_node *node);
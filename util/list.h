@@ -93,6 +93,41 @@ static inline void list_del(struct list_head *entry) {
 	entry->next->prev = entry->prev;
 }
 
+/**
+ * @def list_for_each_rcu(pos, head)
+ * @brief Iterate over all entries in a list inside an RCU read-side critical
+ * section, while writers may add and delete entries concurrently.
+ */
+#define list_for_each_rcu(pos, head)                              \
+	for (pos = __atomic_load_n(&(head)->next, __ATOMIC_CONSUME); \
+		pos != head; pos = __atomic_load_n(&pos->next, __ATOMIC_CONSUME))
+
+/**
+ * @brief Add an entry to a list that is read under RCU. Writers must still be
+ * serialized.
+ * @param new The entry to add, fully initialized.
+ * @param head The list to add the entry to.
+ */
+static inline void list_add_rcu(struct list_head *new, struct list_head *head) {
+	struct list_head *temp = head->next;
+	new->next = temp;
+	new->prev = head;
+	/* Readers only follow next, which must point to the initialized entry */
+	__atomic_store_n(&head->next, new, __ATOMIC_RELEASE);
+	temp->prev = new;
+}
+
+/**
+ * @brief Delete an entry from a list that is read under RCU. The entry keeps
+ * its next pointer for readers that still look at it, so it may only be freed
+ * after a grace period.
+ * @param entry The entry to delete.
+ */
+static inline void list_del_rcu(struct list_head *entry) {
+	__atomic_store_n(&entry->prev->next, entry->next, __ATOMIC_RELEASE);
+	entry->next->prev = entry->prev;
+}
+
 /**
  * @brief Check if a given list is empty.
  * @param head The head of the list.
@@ -0,0 +1,124 @@
+#include "radix.h"
+
+#include "panic.h"
+#include "string.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+static struct radix_node *node_new(struct radix_tree *tree, uint8_t shift) {
+	struct radix_node *node = tree->alloc(sizeof(*node));
+	if (node) {
+		memset(node, 0, sizeof(*node));
+		node->shift = shift;
+	}
+	return node;
+}
+
+static inline bool node_covers(const struct radix_node *node, uint64_t key) {
+	return node->shift + RADIX_BITS >= 64
+		|| !(key >> (node->shift + RADIX_BITS));
+}
+
+/**
+ * @brief Store an item at a key. Adds a level above the root for every
+ * RADIX_BITS the key is too large for, the old root becomes the first child of
+ * the new one. Nodes are fully initialized before they are linked, so
+ * concurrent lookups never see a partial node.
+ * @param tree The tree.
+ * @param key The key.
+ * @param item The item, not nullptr.
+ * @return Whether it was stored, false if the key already has an item or a node
+ * could not be allocated.
+ */
+bool radix_insert(struct radix_tree *tree, uint64_t key, void *item) {
+	if (!item) {
+		panic("radix_insert(): storing nullptr at %w64u", key);
+	}
+
+	struct radix_node *root = tree->root;
+	if (!root) {
+		if (!(root = node_new(tree, 0))) {
+			return false;
+		}
+		__atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+	}
+	while (!node_covers(root, key)) {
+		struct radix_node *parent = node_new(tree, root->shift + RADIX_BITS);
+		if (!parent) {
+			return false;
+		}
+		parent->slots[0] = root;
+		__atomic_store_n(&tree->root, parent, __ATOMIC_RELEASE);
+		root = parent;
+	}
+
+	for (struct radix_node *node = root;;) {
+		void **slot = &node->slots[(key >> node->shift) & (RADIX_SLOTS - 1)];
+		if (!node->shift) {
+			if (*slot) {
+				return false;
+			}
+			__atomic_store_n(slot, item, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		struct radix_node *child = *slot;
+		if (!child) {
+			if (!(child = node_new(tree, node->shift - RADIX_BITS))) {
+				return false;
+			}
+			__atomic_store_n(slot, child, __ATOMIC_RELEASE);
+		}
+		node = child;
+	}
+}
+
+/**
+ * @brief Remove the item stored at a key. Nodes that become empty are kept, the
+ * set of keys in use is expected to stay about the same.
+ * @param tree The tree.
+ * @param key The key.
+ * @return The removed item or nullptr if there was none.
+ */
+void *radix_delete(struct radix_tree *tree, uint64_t key) {
+	struct radix_node *node = tree->root;
+	if (!node || !node_covers(node, key)) {
+		return nullptr;
+	}
+
+	for (;;) {
+		void **slot = &node->slots[(key >> node->shift) & (RADIX_SLOTS - 1)];
+		if (!node->shift) {
+			void *item = *slot;
+			__atomic_store_n(slot, nullptr, __ATOMIC_RELAXED);
+			return item;
+		}
+		if (!(node = *slot)) {
+			return nullptr;
+		}
+	}
+}
+
+static void node_free(struct radix_tree *tree, struct radix_node *node) {
+	if (node->shift) {
+		for (unsigned i = 0; i < RADIX_SLOTS; ++i) {
+			if (node->slots[i]) {
+				node_free(tree, node->slots[i]);
+			}
+		}
+	}
+	tree->free(node);
+}
+
+/**
+ * @brief Free all nodes of a tree, leaving it empty. The items are not touched.
+ * There must be no concurrent lookups.
+ * @param tree The tree.
+ */
+void radix_destroy(struct radix_tree *tree) {
+	if (tree->root) {
+		node_free(tree, tree->root);
+		tree->root = nullptr;
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A radix tree mapping 64 bit integers to pointers. Every node resolves
+ * RADIX_BITS bits of the key and the tree only grows as high as the largest key
+ * requires, so dense small keys such as ids take one or two steps.
+ *
+ * Writers have to be serialized by the caller. Lookups take no lock and may
+ * run concurrently with a writer, as nodes are published with release stores
+ * and are only freed by radix_destroy(). An item removed by radix_delete() may
+ * still be returned to a concurrent lookup, so the caller defers freeing it
+ * (with call_rcu() for example). */
+
+#define RADIX_BITS  (6)
+#define RADIX_SLOTS (1 << RADIX_BITS)
+
+struct radix_node {
+	uint8_t shift; /* Position of the lowest key bit resolved by this node */
+	void *slots[RADIX_SLOTS]; /* Child nodes or, if shift is 0, the items */
+};
+
+struct radix_tree {
+	struct radix_node *root;
+	void *(*alloc)(size_t size);
+	void (*free)(void *ptr);
+};
+
+/**
+ * @def RADIX_TREE_INIT(alloc, free)
+ * @brief Statically initialize an empty tree.
+ * @param alloc Allocates nodes, returns nullptr if there is no memory.
+ * @param free Frees nodes, may be nullptr if the tree is never destroyed.
+ */
+#define RADIX_TREE_INIT(alloc, free) {nullptr, (alloc), (free)}
+
+/**
+ * @brief Find the item stored at a key. Can run concurrently with a writer.
+ * @param tree The tree.
+ * @param key The key.
+ * @return The item or nullptr if there is none.
+ */
+static inline void *radix_lookup(const struct radix_tree *tree, uint64_t key) {
+	struct radix_node *node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+	if (!node || (node->shift + RADIX_BITS < 64
+		&& key >> (node->shift + RADIX_BITS))) {
+		return nullptr;
+	}
+
+	for (;;) {
+		void *slot = __atomic_load_n(
+			&node->slots[(key >> node->shift) & (RADIX_SLOTS - 1)],
+			__ATOMIC_ACQUIRE);
+		if (!node->shift || !slot) {
+			return slot;
+		}
+		node = slot;
+	}
+}
+
+bool radix_insert(struct radix_tree *tree, uint64_t key, void *item);
+void *radix_delete(struct radix_tree *tree, uint64_t key);
+void radix_destroy(struct radix_tree *tree);
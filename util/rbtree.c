@@ -0,0 +1,302 @@
+#include "rbtree.h"
+
+#include <stddef.h>
+
+static void replace_child(struct rb_root *root, struct rb_node *parent,
+	struct rb_node *old, struct rb_node *new) {
+	if (!parent) {
+		root->node = new;
+	} else if (parent->left == old) {
+		parent->left = new;
+	} else {
+		parent->right = new;
+	}
+}
+
+static void rotate_left(struct rb_root *root, struct rb_node *x,
+	rb_augment augment) {
+	struct rb_node *y = x->right;
+
+	x->right = y->left;
+	if (y->left) {
+		y->left->parent = x;
+	}
+	y->parent = x->parent;
+	replace_child(root, x->parent, x, y);
+	y->left = x;
+	x->parent = y;
+
+	/* x is now the child of y, so it has to be updated first */
+	if (augment) {
+		augment(x);
+		augment(y);
+	}
+}
+
+static void rotate_right(struct rb_root *root, struct rb_node *x,
+	rb_augment augment) {
+	struct rb_node *y = x->left;
+
+	x->left = y->right;
+	if (y->right) {
+		y->right->parent = x;
+	}
+	y->parent = x->parent;
+	replace_child(root, x->parent, x, y);
+	y->right = x;
+	x->parent = y;
+
+	if (augment) {
+		augment(x);
+		augment(y);
+	}
+}
+
+static inline bool is_red(const struct rb_node *node) {
+	return node && node->red;
+}
+
+/**
+ * @brief Recompute the augmented values of a node and all of its ancestors.
+ * @param node The node whose value has changed.
+ * @param augment The callback of the tree, may be nullptr.
+ */
+void rb_propagate(struct rb_node *node, rb_augment augment) {
+	if (!augment) {
+		return;
+	}
+	for (; node; node = node->parent) {
+		augment(node);
+	}
+}
+
+/**
+ * @brief Rebalance the tree after a node was linked with rb_link_node().
+ * @param root The tree.
+ * @param node The newly linked node.
+ * @param augment The callback of the tree, may be nullptr.
+ */
+void rb_insert(struct rb_root *root, struct rb_node *node, rb_augment augment) {
+	rb_propagate(node, augment);
+
+	struct rb_node *parent;
+	while ((parent = node->parent) && parent->red) {
+		/* parent is red, thus it is not the root and gparent exists */
+		struct rb_node *gparent = parent->parent;
+
+		if (parent == gparent->left) {
+			struct rb_node *uncle = gparent->right;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				gparent->red = true;
+				node = gparent;
+				continue;
+			}
+
+			if (node == parent->right) {
+				rotate_left(root, parent, augment);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gparent->red = true;
+			rotate_right(root, gparent, augment);
+		} else {
+			struct rb_node *uncle = gparent->left;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				gparent->red = true;
+				node = gparent;
+				continue;
+			}
+
+			if (node == parent->left) {
+				rotate_right(root, parent, augment);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gparent->red = true;
+			rotate_left(root, gparent, augment);
+		}
+	}
+	root->node->red = false;
+}
+
+static void erase_fixup(struct rb_root *root, struct rb_node *x,
+	struct rb_node *parent, rb_augment augment) {
+	while (x != root->node && !is_red(x)) {
+		if (x == parent->left) {
+			struct rb_node *w = parent->right;
+			if (w->red) {
+				w->red = false;
+				parent->red = true;
+				rotate_left(root, parent, augment);
+				w = parent->right;
+			}
+
+			if (!is_red(w->left) && !is_red(w->right)) {
+				w->red = true;
+				x = parent;
+				parent = x->parent;
+				continue;
+			}
+
+			if (!is_red(w->right)) {
+				w->left->red = false;
+				w->red = true;
+				rotate_right(root, w, augment);
+				w = parent->right;
+			}
+			w->red = parent->red;
+			parent->red = false;
+			w->right->red = false;
+			rotate_left(root, parent, augment);
+			x = root->node;
+		} else {
+			struct rb_node *w = parent->left;
+			if (w->red) {
+				w->red = false;
+				parent->red = true;
+				rotate_right(root, parent, augment);
+				w = parent->left;
+			}
+
+			if (!is_red(w->left) && !is_red(w->right)) {
+				w->red = true;
+				x = parent;
+				parent = x->parent;
+				continue;
+			}
+
+			if (!is_red(w->left)) {
+				w->right->red = false;
+				w->red = true;
+				rotate_left(root, w, augment);
+				w = parent->left;
+			}
+			w->red = parent->red;
+			parent->red = false;
+			w->left->red = false;
+			rotate_right(root, parent, augment);
+			x = root->node;
+		}
+	}
+
+	if (x) {
+		x->red = false;
+	}
+}
+
+/**
+ * @brief Remove a node from the tree.
+ * @param root The tree.
+ * @param node The node to remove.
+ * @param augment The callback of the tree, may be nullptr.
+ */
+void rb_erase(struct rb_root *root, struct rb_node *node, rb_augment augment) {
+	/* y is the node that is actually unlinked from its position, it has at
+	 * most one child */
+	struct rb_node *y = node;
+	if (node->left && node->right) {
+		for (y = node->right; y->left; y = y->left);
+	}
+
+	struct rb_node *x = y->left ? y->left : y->right;
+	struct rb_node *parent = y->parent;
+	bool removed_red = y->red;
+
+	replace_child(root, y->parent, y, x);
+	if (x) {
+		x->parent = y->parent;
+	}
+
+	/* Move the successor into the place of the erased node */
+	if (y != node) {
+		if (parent == node) {
+			parent = y;
+		}
+		y->left = node->left;
+		y->right = node->right;
+		y->parent = node->parent;
+		y->red = node->red;
+		if (y->left) {
+			y->left->parent = y;
+		}
+		if (y->right) {
+			y->right->parent = y;
+		}
+		replace_child(root, node->parent, node, y);
+	}
+
+	/* y (if it was moved) is an ancestor of parent */
+	rb_propagate(parent, augment);
+
+	if (!removed_red) {
+		erase_fixup(root, x, parent, augment);
+	}
+}
+
+/**
+ * @brief Get the leftmost (smallest) node of a tree.
+ * @return The node or nullptr if the tree is empty.
+ */
+struct rb_node *rb_first(const struct rb_root *root) {
+	struct rb_node *node = root->node;
+	if (!node) {
+		return nullptr;
+	}
+	for (; node->left; node = node->left);
+	return node;
+}
+
+/**
+ * @brief Get the rightmost (largest) node of a tree.
+ * @return The node or nullptr if the tree is empty.
+ */
+struct rb_node *rb_last(const struct rb_root *root) {
+	struct rb_node *node = root->node;
+	if (!node) {
+		return nullptr;
+	}
+	for (; node->right; node = node->right);
+	return node;
+}
+
+/**
+ * @brief Get the in-order successor of a node.
+ * @return The successor or nullptr if node is the last node.
+ */
+struct rb_node *rb_next(const struct rb_node *node) {
+	if (node->right) {
+		node = node->right;
+		for (; node->left; node = node->left);
+		return (struct rb_node *)node;
+	}
+
+	struct rb_node *parent;
+	while ((parent = node->parent) && node == parent->right) {
+		node = parent;
+	}
+	return parent;
+}
+
+/**
+ * @brief Get the in-order predecessor of a node.
+ * @return The predecessor or nullptr if node is the first node.
+ */
+struct rb_node *rb_prev(const struct rb_node *node) {
+	if (node->left) {
+		node = node->left;
+		for (; node->right; node = node->right);
+		return (struct rb_node *)node;
+	}
+
+	struct rb_node *parent;
+	while ((parent = node->parent) && node == parent->left) {
+		node = parent;
+	}
+	return parent;
+}
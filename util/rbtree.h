@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+
+struct rb_node {
+	struct rb_node *parent;
+	struct rb_node *left, *right;
+	bool red;
+};
+
+struct rb_root {
+	struct rb_node *node;
+};
+
+/**
+ * @def RB_ROOT_INIT
+ * @brief Statically initialize an empty tree.
+ */
+#define RB_ROOT_INIT {nullptr}
+
+/**
+ * @def rb_entry(ptr, type, member)
+ * @brief Get the struct for this node.
+ * @param ptr The ptr to the node.
+ * @param type The type of the struct this is embedded in.
+ * @param member The name of the rb_node within the struct.
+ */
+#define rb_entry(ptr, type, member) \
+	((type *)((void *)(ptr) - offsetof(type, member)))
+
+/**
+ * @brief Callback for augmented trees. Recomputes the augmented value of a node
+ * from the node itself and its children.
+ */
+typedef void (*rb_augment)(struct rb_node *node);
+
+/**
+ * @brief Link a new node into the tree at a position found by the caller. Must
+ * be followed by rb_insert().
+ * @param node The node to link.
+ * @param parent The parent of the new node, nullptr if the tree is empty.
+ * @param link The left or right pointer of parent (or the tree's root pointer)
+ * that is to point to the new node.
+ */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+	struct rb_node **link) {
+	node->parent = parent;
+	node->left = nullptr;
+	node->right = nullptr;
+	node->red = true;
+	*link = node;
+}
+
+void rb_insert(struct rb_root *root, struct rb_node *node, rb_augment augment);
+void rb_erase(struct rb_root *root, struct rb_node *node, rb_augment augment);
+void rb_propagate(struct rb_node *node, rb_augment augment);
+
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "panic.h"
+
+#include <stdint.h>
+
+/* Bounded lock-free queues of pointers. The caller provides the storage, whose
+ * size must be a power of two. Positions are free running 32 bit counters that
+ * are masked to index the storage, so they may wrap. The indices of the
+ * producers and of the consumer are on separate cache lines. */
+
+/**
+ * @struct spsc_ring
+ * @brief A queue for a single producer and a single consumer, which may run on
+ * different processors. Each side keeps a copy of the other side's index and
+ * only reads the shared one when the copy says the ring is full or empty.
+ */
+struct spsc_ring {
+	alignas(64) uint32_t tail; /* Next position to write, producer */
+	uint32_t head_cache; /* Producer's copy of head */
+	alignas(64) uint32_t head; /* Next position to read, consumer */
+	uint32_t tail_cache; /* Consumer's copy of tail */
+	alignas(64) uint32_t mask; /* The size minus 1 */
+	void **slots;
+};
+
+/**
+ * @brief Initialize an empty SPSC ring.
+ * @param ring The ring.
+ * @param slots The storage.
+ * @param size The number of slots, a power of two.
+ */
+static inline void spsc_ring_init(struct spsc_ring *ring, void **slots,
+	uint32_t size) {
+	if (!size || size & (size - 1)) {
+		panic("spsc_ring_init(): size %w32u is not a power of two", size);
+	}
+	ring->tail = 0;
+	ring->head_cache = 0;
+	ring->head = 0;
+	ring->tail_cache = 0;
+	ring->mask = size - 1;
+	ring->slots = slots;
+}
+
+/**
+ * @brief Append items to an SPSC ring. Only called by the producer.
+ * @param ring The ring.
+ * @param items The items to append.
+ * @param count The number of items.
+ * @return The number of items appended, less than count if the ring is full.
+ */
+static inline uint32_t spsc_ring_push_batch(struct spsc_ring *ring,
+	void *const *items, uint32_t count) {
+	uint32_t tail = ring->tail;
+	uint32_t size = ring->mask + 1;
+	if (tail - ring->head_cache + count > size) {
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	}
+	uint32_t free = size - (tail - ring->head_cache);
+	count = count < free ? count : free;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		ring->slots[(tail + i) & ring->mask] = items[i];
+	}
+	/* Publishes the slots to the consumer */
+	__atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+/**
+ * @brief Take items from an SPSC ring. Only called by the consumer.
+ * @param ring The ring.
+ * @param items Receives the items, oldest first.
+ * @param count The maximum number of items.
+ * @return The number of items taken, 0 if the ring is empty.
+ */
+static inline uint32_t spsc_ring_pop_batch(struct spsc_ring *ring,
+	void **items, uint32_t count) {
+	uint32_t head = ring->head;
+	if (ring->tail_cache - head < count) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	}
+	uint32_t used = ring->tail_cache - head;
+	count = count < used ? count : used;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		items[i] = ring->slots[(head + i) & ring->mask];
+	}
+	/* Hands the slots back to the producer */
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+/**
+ * @brief Append an item to an SPSC ring. Only called by the producer.
+ * @param ring The ring.
+ * @param item The item.
+ * @return Whether it was appended, false if the ring is full.
+ */
+static inline bool spsc_ring_push(struct spsc_ring *ring, void *item) {
+	return spsc_ring_push_batch(ring, &item, 1);
+}
+
+/**
+ * @brief Take the oldest item from an SPSC ring. Only called by the consumer.
+ * @param ring The ring.
+ * @param item Receives the item.
+ * @return Whether there was an item.
+ */
+static inline bool spsc_ring_pop(struct spsc_ring *ring, void **item) {
+	return spsc_ring_pop_batch(ring, item, 1);
+}
+
+/**
+ * @struct mpsc_slot
+ * @brief The storage of an MPSC queue. The sequence number of a slot tells
+ * whose turn it is: it equals the position while the slot is free for the
+ * producer of that position, and the position plus 1 once the item is written.
+ */
+struct mpsc_slot {
+	uint32_t seq;
+	void *item;
+};
+
+/**
+ * @struct mpsc_queue
+ * @brief A queue for any number of producers and a single consumer. Producers
+ * claim positions with a CAS on tail and publish each slot through its
+ * sequence number, so the consumer never waits for a lock.
+ */
+struct mpsc_queue {
+	alignas(64) uint32_t tail; /* Next position to claim, producers */
+	alignas(64) uint32_t head; /* Next position to read, consumer */
+	alignas(64) uint32_t mask; /* The size minus 1 */
+	struct mpsc_slot *slots;
+};
+
+/**
+ * @brief Initialize an empty MPSC queue.
+ * @param queue The queue.
+ * @param slots The storage.
+ * @param size The number of slots, a power of two.
+ */
+static inline void mpsc_queue_init(struct mpsc_queue *queue,
+	struct mpsc_slot *slots, uint32_t size) {
+	if (!size || size & (size - 1)) {
+		panic("mpsc_queue_init(): size %w32u is not a power of two", size);
+	}
+	for (uint32_t i = 0; i < size; ++i) {
+		slots[i].seq = i;
+	}
+	queue->tail = 0;
+	queue->head = 0;
+	queue->mask = size - 1;
+	queue->slots = slots;
+}
+
+/**
+ * @brief Append items to an MPSC queue as one contiguous run. Can be called by
+ * any number of producers at once.
+ * @param queue The queue.
+ * @param items The items to append.
+ * @param count The number of items, at most the size of the queue.
+ * @return Whether they were appended, false if there is not enough room for
+ * all of them.
+ */
+static inline bool mpsc_queue_push_batch(struct mpsc_queue *queue,
+	void *const *items, uint32_t count) {
+	uint32_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		/* The consumer frees slots in order, so if the last slot of the run
+		 * is free, all of them are */
+		uint32_t last = pos + count - 1;
+		uint32_t seq = __atomic_load_n(&queue->slots[last & queue->mask].seq,
+			__ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - last);
+		if (diff < 0) {
+			return false;
+		}
+		if (diff == 0
+			&& __atomic_compare_exchange_n(&queue->tail, &pos, pos + count,
+				true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+		if (diff > 0) {
+			/* Another producer claimed the position in the meantime */
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		struct mpsc_slot *slot = &queue->slots[(pos + i) & queue->mask];
+		slot->item = items[i];
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+/**
+ * @brief Take items from an MPSC queue. Only called by the consumer. Stops at
+ * the first slot that was claimed but not written yet.
+ * @param queue The queue.
+ * @param items Receives the items, oldest first.
+ * @param count The maximum number of items.
+ * @return The number of items taken, 0 if the queue is empty.
+ */
+static inline uint32_t mpsc_queue_pop_batch(struct mpsc_queue *queue,
+	void **items, uint32_t count) {
+	uint32_t head = queue->head;
+	uint32_t taken = 0;
+	for (; taken < count; ++taken, ++head) {
+		struct mpsc_slot *slot = &queue->slots[head & queue->mask];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1) {
+			break;
+		}
+		items[taken] = slot->item;
+		/* Free for the producer of the same slot one lap later */
+		__atomic_store_n(&slot->seq, head + queue->mask + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&queue->head, head, __ATOMIC_RELAXED);
+	return taken;
+}
+
+/**
+ * @brief Append an item to an MPSC queue. Can be called by any number of
+ * producers at once.
+ * @param queue The queue.
+ * @param item The item.
+ * @return Whether it was appended, false if the queue is full.
+ */
+static inline bool mpsc_queue_push(struct mpsc_queue *queue, void *item) {
+	return mpsc_queue_push_batch(queue, &item, 1);
+}
+
+/**
+ * @brief Take the oldest item from an MPSC queue. Only called by the consumer.
+ * @param queue The queue.
+ * @param item Receives the item.
+ * @return Whether there was an item.
+ */
+static inline bool mpsc_queue_pop(struct mpsc_queue *queue, void **item) {
+	return mpsc_queue_pop_batch(queue, item, 1);
+}